@@ -1,7 +1,15 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "circalloc.h"
+#include "circhost.h"
+#include "testschema.h"
 
 // Some simple test code
 #define ASSERT_EQ(a,b) if ((a) != (b)) { printf("ASSERT_EQ(" #a ", " #b ") FAILED in %s::%s()::%d.\n", __FILE__, __FUNCTION__, __LINE__); exit(1); }
@@ -11,139 +19,93 @@
 #define ASSERT_GE(a,b) if ((a) < (b)) { printf("ASSERT_GE(" #a ", " #b ") FAILED in %s::%s()::%d.\n", __FILE__, __FUNCTION__, __LINE__); exit(1); }
 #define ASSERT_GT(a,b) if ((a) <= (b)) { printf("ASSERT_GT(" #a ", " #b ") FAILED in %s::%s()::%d.\n", __FILE__, __FUNCTION__, __LINE__); exit(1); }
 
-// Must be a multiple of alignment, e.g. 16.
-#define BUFFSIZE 2048
-
 // Local datastructure for fixed memory allocation
 uint8_t buffer[BUFFSIZE];
 
-// If head == tail, then we are empty.
-uint32_t head;
-uint32_t tail;
-
-// Some details on our list
-#define HDR_FREE 0     // This block is free
-#define HDR_INUSE 1    // This block is in use
-#define HDR_GAP 2      // This is a gap block. See free pointer for next element
-
-// Must be 16 bytes or less in size, which is also our alignment.
-struct hdr {
-    uint8_t free;
-    uint32_t len;
-};
-
-uint32_t avail()
+uint32_t testgetoffset(void *addr)
 {
-    return head >= tail ?
-        BUFFSIZE - head + tail :
-        tail - head;
+    if (addr == NULL) return -1;
+    return (uint32_t)((uint8_t *)addr - buffer);
 }
 
-void circallocblock(uint32_t size, uint8_t hdr_free)
+void *testalloc(uint32_t size)
 {
-    if (size == 0) return;
-    struct hdr *meta;
-    meta = (struct hdr *)(buffer + head);
-    meta->free = hdr_free;
-    meta->len = size;
-    head = (head + size) % BUFFSIZE;
+    void *p = circalloc(size);
+    printf("circalloc(%d); addr(offset)=0x%08x (head=0x%04x; tail=0x%04x)\n", size, testgetoffset(p), circ_head, circ_tail);
+    return p;
 }
 
-void *circalloc(uint32_t size)
+void testfree(void *addr)
 {
-    int offset = head;
-    int rem = 0;
-
-    // Ensure additional memory for our header, which is always at the
-    // beginning. The total size is aligned to 16 bytes. That means every time
-    // we allocate, the start of the buffer is always aligned to 16 bytes.
-    int block_size = (size + sizeof(struct hdr) + 0xF) & ~0xF;
-
-    // Take into account that we might want to wrap. So if the head > tail, and
-    // we allocate more than what there is at the end, we need to ignore the end
-    // by allocating an extra chunk.
-    if (head >= tail && (BUFFSIZE - head < block_size)) {
-        rem = BUFFSIZE - head;     // We know this is already aligned
-        offset = 0;
-    }
+    circfree(addr);
+    printf("circfree(0x%08x); (head=0x%04x; tail=0x%04x)\n", testgetoffset(addr), circ_head, circ_tail);
+}
 
-    // Not enough memory. Note the equals, so that head == tail is empty is
-    // preserved.
-    if (avail() <= block_size + rem) return NULL;
+void *testemitted[8];
+int testemitcount;
 
-    // Doing this lockless is not yet considered. `circalloc` and `circfree` may
-    // all be called simultaneously, so the `meta`, `head, `tail` must all be
-    // set atomically.
-    circallocblock(rem, HDR_GAP);
-    circallocblock(block_size, HDR_INUSE);
+void testsink(void *addr)
+{
+    printf("emit(0x%08x)\n", testgetoffset(addr));
+    testemitted[testemitcount++] = addr;
+}
 
-    return buffer + offset + sizeof(struct hdr);
+void testhandle(void *ctx, void *block)
+{
+    printf("handle(0x%08x)\n", testgetoffset(block));
+    (*(int *)ctx)++;
 }
 
-void circfree(void* addr)
+uint32_t testflushed[4][2];
+int testflushcount;
+
+void testflush(uint32_t offset, uint32_t len)
 {
-    struct hdr *meta;
-    struct hdr *gmeta = NULL;
-    meta = (struct hdr *)(addr - sizeof(struct hdr));
-
-    // Mark this block as free. It might not be the tail, and might be somewhere
-    // in the middle. If it's the head, we don't allow that memory yet to be
-    // reclaimed until the tail catches up.
-    meta->free = HDR_FREE;
-
-    // If there is corruption in the structure, this might result in an infinite
-    // loop.
-    meta = (struct hdr *)(buffer + tail);
-    do {
-        switch(meta->free) {
-        case HDR_INUSE:
-            return;
-        case HDR_GAP:
-            // To know if this is free, we need to find the next element. It is
-            // an error to have to HDR_GAP after each other, or no other buffer
-            // at all. This is special, because the user will never pass the
-            // pointer to this block when freeing (as the user never knows about
-            // it).
-            gmeta = meta;
-            int gtail = (tail + gmeta->len) % BUFFSIZE;
-            meta = (struct hdr *)(buffer + gtail);
-            break;
-        case HDR_FREE:
-            if (gmeta) tail = (tail + gmeta->len) % BUFFSIZE;
-            tail = (tail + meta->len) % BUFFSIZE;
-            gmeta = NULL;
-            meta = (struct hdr *)(buffer + tail);
-            break;
-        }
-    } while (head != tail);
+    printf("flush(0x%04x, 0x%04x)\n", offset, len);
+    testflushed[testflushcount][0] = offset;
+    testflushed[testflushcount][1] = len;
+    testflushcount++;
 }
 
+uint64_t testnow;
 
+uint64_t testclock(void)
+{
+    return testnow;
+}
 
-uint32_t testgetoffset(void *addr)
+uint8_t testdumped[BUFFSIZE + 1024];
+uint32_t testdumplen;
+
+void testout(const void *data, uint32_t len)
 {
-    if (addr == NULL) return -1;
-    return (uint32_t)((uint8_t *)addr - buffer);
+    for (uint32_t i = 0; i < len; i++) {
+        testdumped[testdumplen++] = ((const uint8_t *)data)[i];
+    }
 }
 
-void *testalloc(uint32_t size)
+struct testdecoded {
+    uint32_t values[16];
+    int count;
+};
+
+void testdecode(void *ctx, const void *payload, uint32_t len)
 {
-    void *p = circalloc(size);
-    printf("circalloc(%d); addr(offset)=0x%08x (head=0x%04x; tail=0x%04x)\n", size, testgetoffset(p), head, tail);
-    return p;
+    struct testdecoded *out = ctx;
+    out->values[out->count++] = *(const uint32_t *)payload;
 }
 
-void testfree(void *addr)
+void testassert(const char *expr, const char *file, int line)
 {
-    circfree(addr);
-    printf("circfree(0x%08x); (head=0x%04x; tail=0x%04x)\n", testgetoffset(addr), head, tail);
+    printf("CIRC_ASSERT(%s) FAILED in %s::%d.\n", expr, file, line);
+    exit(1);
 }
 
 void testreset(const char *testcasename)
 {
     printf("\nRESET: %s\n", testcasename);
-    head = 0;
-    tail = 0;
+    circreset();
+    circ_profilerate = 0;
 }
 
 int testgetaligned(uint32_t size)
@@ -157,147 +119,973 @@ int testgetaligned(uint32_t size)
 // Metadata Size = 0x0008  `sizeof(struct hdr)`.
 int main(void)
 {
-    void *p1, *p2, *p3, *p4;
+    void *p1, *p2, *p3, *p4, *p5, *p6;
+    uint32_t pos;
     int msize = sizeof(struct hdr);
     printf("Metadata Size = 0x%04d\n\n", msize);
+    circassert = testassert;
     ASSERT_LE(msize, 16);          // The structure must be less than the alignment we chose
 
     // TEST 1: Allocate and free in order
     testreset("Allocate and free in order");
     p1 = testalloc(10);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x20);         // aligned(10 + 8) = 0x20.
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x20);    // aligned(10 + 8) = 0x20.
     p2 = testalloc(8);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x30);         // 0x20 + aligned(8 + 8);
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x30);    // 0x20 + aligned(8 + 8);
     p3 = testalloc(1001);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x430);        // 0x30 + aligned(1001 + 8) = 0z430
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x430);   // 0x30 + aligned(1001 + 8) = 0z430
     testfree(p1);                  // Now free the tail, it should immediately increment the tail
-    ASSERT_EQ(tail, 0x20);
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x20);
+    ASSERT_EQ(circ_head, 0x430);
     testfree(p2);
-    ASSERT_EQ(tail, 0x30);
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x30);
+    ASSERT_EQ(circ_head, 0x430);
     testfree(p3);
-    ASSERT_EQ(tail, 0x430);
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x430);
+    ASSERT_EQ(circ_head, 0x430);
 
 
     // TEST 2: Allocate and free out of order (but not the last)
     testreset("Allocate and then free out of order");
     p1 = testalloc(10);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x20);         // aligned(10 + 8) = 0x20.
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x20);    // aligned(10 + 8) = 0x20.
     p2 = testalloc(8);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x30);         // 0x20 + aligned(8 + 8);
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x30);    // 0x20 + aligned(8 + 8);
     p3 = testalloc(1001);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x430);        // 0x30 + aligned(1001 + 8) = 0z430
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x430);   // 0x30 + aligned(1001 + 8) = 0z430
     testfree(p2);
-    ASSERT_EQ(tail, 0x00);         // The tail wasn't freed, so it looks allocated
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x00);    // The tail wasn't freed, so it looks allocated
+    ASSERT_EQ(circ_head, 0x430);
     testfree(p1);
-    ASSERT_EQ(tail, 0x30);
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x30);
+    ASSERT_EQ(circ_head, 0x430);
     testfree(p3);
-    ASSERT_EQ(tail, 0x430);
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x430);
+    ASSERT_EQ(circ_head, 0x430);
 
     // TEST 3: Allocate and free out of order (the last entry first)
     testreset("Allocate and then free out of order, the head first");
     p1 = testalloc(10);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x20);         // aligned(10 + 8) = 0x20.
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x20);    // aligned(10 + 8) = 0x20.
     p2 = testalloc(8);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x30);         // 0x20 + aligned(8 + 8);
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x30);    // 0x20 + aligned(8 + 8);
     p3 = testalloc(1001);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x430);        // 0x30 + aligned(1001 + 8) = 0z430
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x430);   // 0x30 + aligned(1001 + 8) = 0z430
     testfree(p3);
-    ASSERT_EQ(tail, 0x0);          // The tail wasn't freed, so it looks allocated
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x0);     // The tail wasn't freed, so it looks allocated
+    ASSERT_EQ(circ_head, 0x430);
     testfree(p2);                  // The tail still isn't freed
-    ASSERT_EQ(tail, 0x0);
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x0);
+    ASSERT_EQ(circ_head, 0x430);
     testfree(p1);
-    ASSERT_EQ(tail, 0x430);
-    ASSERT_EQ(head, 0x430);
+    ASSERT_EQ(circ_tail, 0x430);
+    ASSERT_EQ(circ_head, 0x430);
 
     // TEST 4: Allocate so we precisely reach the end
     testreset("Allocate to precisely reach the end");
-    head = BUFFSIZE - 48;
-    tail = head;
+    circ_head = BUFFSIZE - 48;
+    circ_tail = circ_head;
     p1 = testalloc(30);
-    ASSERT_EQ(tail, BUFFSIZE - 48);
-    ASSERT_EQ(head, 0);            // the head should have wrapped around
+    ASSERT_EQ(circ_tail, BUFFSIZE - 48);
+    ASSERT_EQ(circ_head, 0);       // the head should have wrapped around
     p2 = testalloc(20);
-    ASSERT_EQ(tail, BUFFSIZE - 48);
-    ASSERT_EQ(head, 0x20);
+    ASSERT_EQ(circ_tail, BUFFSIZE - 48);
+    ASSERT_EQ(circ_head, 0x20);
     testfree(p1);
-    ASSERT_EQ(tail, 0);
-    ASSERT_EQ(head, 0x20);
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x20);
     testfree(p2);
-    ASSERT_EQ(tail, 0x20);
-    ASSERT_EQ(head, 0x20);
+    ASSERT_EQ(circ_tail, 0x20);
+    ASSERT_EQ(circ_head, 0x20);
 
     // TEST 5: Allocate so we have to wrap around
     testreset("Allocate near the end");
-    head = BUFFSIZE - 48;
-    tail = head;
+    circ_head = BUFFSIZE - 48;
+    circ_tail = circ_head;
     p1 = testalloc(1000);
-    ASSERT_EQ(tail, BUFFSIZE - 48);
-    ASSERT_EQ(head, 0x3F0);        // Metadata is at 0x7D0, pointer is at the buffer
+    ASSERT_EQ(circ_tail, BUFFSIZE - 48);
+    ASSERT_EQ(circ_head, 0x3F0);   // Metadata is at 0x7D0, pointer is at the buffer
     ASSERT_EQ(p1, buffer + msize); // And because we can't allocate 1000 bytes here, it must move forward to `buffer`
     p2 = testalloc(20);
-    ASSERT_EQ(tail, BUFFSIZE - 48);
-    ASSERT_EQ(head, 0x410);
+    ASSERT_EQ(circ_tail, BUFFSIZE - 48);
+    ASSERT_EQ(circ_head, 0x410);
     testfree(p1);
-    ASSERT_EQ(tail, 0x3F0);
-    ASSERT_EQ(head, 0x410);
+    ASSERT_EQ(circ_tail, 0x3F0);
+    ASSERT_EQ(circ_head, 0x410);
     testfree(p2);
-    ASSERT_EQ(tail, 0x410);
-    ASSERT_EQ(head, 0x410);
+    ASSERT_EQ(circ_tail, 0x410);
+    ASSERT_EQ(circ_head, 0x410);
 
     // TEST 6: Allocate the maximum amount possible, such that we also need to
     // wrap.
     testreset("Allocating all memory starting in the middle");
-    head = 512;
-    tail = 512;
+    circ_head = 512;
+    circ_tail = 512;
     p1 = testalloc(1500);
-    ASSERT_EQ(tail, 0x200);
-    ASSERT_EQ(head, 0x7F0);        // 1500 + 8, rounded is 0x5F0.
+    ASSERT_EQ(circ_tail, 0x200);
+    ASSERT_EQ(circ_head, 0x7F0);   // 1500 + 8, rounded is 0x5F0.
     p2 = testalloc(250);
-    ASSERT_EQ(tail, 0x200);
-    ASSERT_EQ(head, 0x110);        // Had to wrap around. Pad with 16 bytes, then alloc 0x110.
+    ASSERT_EQ(circ_tail, 0x200);
+    ASSERT_EQ(circ_head, 0x110);   // Had to wrap around. Pad with 16 bytes, then alloc 0x110.
     p3 = testalloc(120);
-    ASSERT_EQ(tail, 0x200);
-    ASSERT_EQ(head, 0x190);        // 120 + 128 bytes.
+    ASSERT_EQ(circ_tail, 0x200);
+    ASSERT_EQ(circ_head, 0x190);   // 120 + 128 bytes.
     p4 = testalloc(121);
     ASSERT_EQ(p4, NULL);
-    ASSERT_EQ(tail, 0x200);
-    ASSERT_EQ(head, 0x190);        // Nothing changed
+    ASSERT_EQ(circ_tail, 0x200);
+    ASSERT_EQ(circ_head, 0x190);   // Nothing changed
     p4 = testalloc(104);           // 104 + 8 = 112, which is exactly how much is remaining
     ASSERT_EQ(p4, NULL);           // And fails because head cannot equal tail, unless empty.
-    ASSERT_EQ(tail, 0x200);
-    ASSERT_EQ(head, 0x190);        // Nothing changed
+    ASSERT_EQ(circ_tail, 0x200);
+    ASSERT_EQ(circ_head, 0x190);   // Nothing changed
     p4 = testalloc(88);            // 88 + 8 = 96, which now should work.
-    ASSERT_EQ(tail, 0x200);
-    ASSERT_EQ(head, 0x1F0);        // We're now full.
+    ASSERT_EQ(circ_tail, 0x200);
+    ASSERT_EQ(circ_head, 0x1F0);   // We're now full.
     testfree(p1);
-    ASSERT_EQ(tail, 0x7F0);
-    ASSERT_EQ(head, 0x1F0);
+    ASSERT_EQ(circ_tail, 0x7F0);
+    ASSERT_EQ(circ_head, 0x1F0);
     testfree(p3);
-    ASSERT_EQ(tail, 0x7F0);        // Didn't free at the tail, so no change
-    ASSERT_EQ(head, 0x1F0);
+    ASSERT_EQ(circ_tail, 0x7F0);   // Didn't free at the tail, so no change
+    ASSERT_EQ(circ_head, 0x1F0);
     testfree(p2);
-    ASSERT_EQ(tail, 0x190);        // Now frees p2, p3
-    ASSERT_EQ(head, 0x1F0);
+    ASSERT_EQ(circ_tail, 0x190);   // Now frees p2, p3
+    ASSERT_EQ(circ_head, 0x1F0);
+    testfree(p4);
+    ASSERT_EQ(circ_tail, 0x1F0);
+    ASSERT_EQ(circ_head, 0x1F0);
+
+    // TEST 7: Two consumers claim blocks in batches, and the idle one steals
+    testreset("Consumers claim in batches and steal");
+    struct worker workers[2] = { 0 };
+    p1 = testalloc(10);
+    p2 = testalloc(10);
+    p3 = testalloc(10);
+    p4 = testalloc(10);
+    p5 = testalloc(10);
+    p6 = testalloc(10);
+    ASSERT_EQ(circ_head, 0xC0);
+    ASSERT_EQ(circwork(workers, 2, 0), p1);   // Claims p1..p4
+    ASSERT_EQ(circ_claim, 0x80);
+    ASSERT_EQ(circwork(workers, 2, 1), p5);   // Claims p5, p6
+    ASSERT_EQ(circ_claim, 0xC0);
+    ASSERT_EQ(circwork(workers, 2, 1), p6);
+    testfree(p6);
+    testfree(p5);
+    ASSERT_EQ(circ_tail, 0);       // Freed out of order, p1 is still in use
+    ASSERT_EQ(circwork(workers, 2, 1), p4);   // Ring is drained, steal from 0
     testfree(p4);
-    ASSERT_EQ(tail, 0x1F0);
-    ASSERT_EQ(head, 0x1F0);
+    ASSERT_EQ(circwork(workers, 2, 0), p2);
+    testfree(p2);
+    testfree(p1);
+    ASSERT_EQ(circ_tail, 0x40);    // p1 and p2 are reclaimed, p3 is in use
+    ASSERT_EQ(circwork(workers, 2, 0), p3);
+    ASSERT_EQ(circwork(workers, 2, 0), NULL);
+    ASSERT_EQ(circwork(workers, 2, 1), NULL);
+    testfree(p3);
+    ASSERT_EQ(circ_tail, 0xC0);
+    ASSERT_EQ(circ_head, 0xC0);
+    testfree(testalloc(8));        // Abandoned before anyone claimed it
+    ASSERT_EQ(circ_claim, 0xD0);   // Moved with the tail
+    p1 = testalloc(8);
+    p2 = testalloc(8);
+    testfree(p2);                  // Freed by its producer, but not reclaimed
+    ASSERT_EQ(circwork(workers, 2, 0), p1);
+    ASSERT_EQ(circwork(workers, 2, 0), NULL); // p2 is skipped
+    ASSERT_EQ(circ_claim, circ_head);
+    testfree(p1);
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 8: Consumers skip over gap blocks
+    testreset("Consumers skip gap blocks");
+    circ_head = BUFFSIZE - 48;
+    circ_tail = circ_head;
+    circ_claim = circ_head;
+    p1 = testalloc(1000);
+    p2 = testalloc(20);
+    ASSERT_EQ(circnext(&circ_claim, circ_head), p1);
+    ASSERT_EQ(circ_claim, 0x3F0);
+    ASSERT_EQ(circnext(&circ_claim, circ_head), p2);
+    ASSERT_EQ(circnext(&circ_claim, circ_head), NULL);
+    testfree(p2);
+    testfree(p1);
+    ASSERT_EQ(circ_tail, 0x410);
+
+    // TEST 9: A pipeline of three stages, each only seeing what the previous
+    // stage finished, and the last stage freeing.
+    testreset("Pipeline stages follow each other");
+    uint32_t stages[3] = { 0, 0, 0 };
+    p1 = testalloc(10);
+    p2 = testalloc(8);
+    ASSERT_EQ(circstage(stages, 1), NULL);    // Stage 0 hasn't finished p1
+    ASSERT_EQ(circstage(stages, 0), p1);
+    ASSERT_EQ(circstage(stages, 0), p1);      // Still p1 until it's done
+    circstagedone(stages, 0);
+    ASSERT_EQ(circstage(stages, 0), p2);
+    ASSERT_EQ(circstage(stages, 1), p1);
+    ASSERT_EQ(circstage(stages, 2), NULL);
+    circstagedone(stages, 1);
+    circstagedone(stages, 0);
+    ASSERT_EQ(circstage(stages, 0), NULL);
+    ASSERT_EQ(circstage(stages, 1), p2);
+    ASSERT_EQ(circstage(stages, 2), p1);
+    circstagedone(stages, 2);
+    testfree(p1);
+    ASSERT_EQ(circ_tail, 0x20);
+    circstagedone(stages, 1);
+    ASSERT_EQ(circstage(stages, 2), p2);
+    circstagedone(stages, 2);
+    testfree(p2);
+    ASSERT_EQ(circ_tail, 0x30);
+    ASSERT_EQ(circ_head, 0x30);
+    ASSERT_EQ(stages[2], 0x30);
+
+    // TEST 10: Blocks processed out of order are emitted in allocation order
+    testreset("Emit processed blocks in order");
+    testemitcount = 0;
+    p1 = testalloc(10);
+    p2 = testalloc(8);
+    p3 = testalloc(20);
+    p4 = testalloc(30);
+    circdone(p3);
+    circdone(p2);
+    ASSERT_EQ(circemit(testsink), 0);         // p1 isn't done yet
+    ASSERT_EQ(circ_tail, 0);
+    circdone(p1);
+    ASSERT_EQ(circemit(testsink), 3);
+    ASSERT_EQ(testemitted[0], p1);
+    ASSERT_EQ(testemitted[1], p2);
+    ASSERT_EQ(testemitted[2], p3);
+    ASSERT_EQ(circ_tail, 0x50);    // p4 is still being processed
+    testfree(p4);                  // Freeing directly still works
+    ASSERT_EQ(circ_tail, 0x80);
+    ASSERT_EQ(circ_head, 0x80);
+    ASSERT_EQ(circemit(testsink), 0);
+
+    // TEST 11: Committed blocks are synced together, in order
+    testreset("Group commit syncs committed blocks at once");
+    testflushcount = 0;
+    p1 = testalloc(10);
+    p2 = testalloc(8);
+    p3 = testalloc(20);
+    circcommit(p1);
+    circcommit(p3);
+    ASSERT_EQ(circsync(testflush), 1);        // p2 isn't committed, so p3 waits
+    ASSERT_EQ(testflushcount, 1);
+    ASSERT_EQ(testflushed[0][0], 0);
+    ASSERT_EQ(testflushed[0][1], 0x20);
+    ASSERT_EQ(circdurable(p1), 1);
+    ASSERT_EQ(circdurable(p3), 0);
+    pos = circ_tail;
+    ASSERT_EQ(circnext(&pos, circ_head), p1);
+    ASSERT_EQ(circnext(&pos, circ_head), p2);
+    ASSERT_EQ(circnext(&pos, circ_head), NULL); // Consumers wait until p3 is durable
+    circcommit(p2);
+    ASSERT_EQ(circsync(testflush), 2);
+    ASSERT_EQ(testflushcount, 2);
+    ASSERT_EQ(testflushed[1][0], 0x20);
+    ASSERT_EQ(testflushed[1][1], 0x30);
+    ASSERT_EQ(circdurable(p2), 1);
+    ASSERT_EQ(circnext(&pos, circ_head), p3);
+    ASSERT_EQ(circsync(testflush), 0);
+    ASSERT_EQ(testflushcount, 2);
+    testfree(p3);
+    testfree(p1);
+    testfree(p2);
+    ASSERT_EQ(circ_tail, 0x50);
+    ASSERT_EQ(circ_head, 0x50);
+    p1 = testalloc(8);             // Freed without ever being synced
+    testfree(p1);
+    p1 = testalloc(8);
+    circcommit(p1);
+    ASSERT_EQ(circdurable(p1), 0);            // `circ_synced` moved with the tail
+    ASSERT_EQ(circsync(testflush), 1);
+    ASSERT_EQ(circdurable(p1), 1);
+    testfree(p1);
+    testreset("Group commit after freeing past the synced blocks");
+    testflushcount = 0;
+    p1 = testalloc(8);
+    circcommit(p1);
+    ASSERT_EQ(circsync(testflush), 1);
+    testfree(p1);
+    p2 = testalloc(8);             // Abandoned
+    testfree(p2);
+    ASSERT_EQ(circ_synced, 0x20);
+    p3 = testalloc(BUFFSIZE - 0x20 - msize);  // Up to the end
+    testfree(p3);
+    ASSERT_EQ(circ_synced, 0);
+    p1 = testalloc(40);            // Over the block `circ_synced` pointed at
+    circcommit(p1);
+    ASSERT_EQ(circsync(testflush), 1);
+    ASSERT_EQ(testflushed[1][0], 0);
+    ASSERT_EQ(testflushed[1][1], 0x30);
+    ASSERT_EQ(circdurable(p1), 1);
+    testfree(p1);
+
+    // TEST 12: A sync that wraps around is split in two
+    testreset("Group commit across the end of the buffer");
+    circ_head = BUFFSIZE - 48;
+    circ_tail = circ_head;
+    circ_synced = circ_head;
+    testflushcount = 0;
+    p1 = testalloc(10);
+    p2 = testalloc(1000);
+    circcommit(p1);
+    circcommit(p2);
+    ASSERT_EQ(circsync(testflush), 2);
+    ASSERT_EQ(testflushcount, 2);
+    ASSERT_EQ(testflushed[0][0], BUFFSIZE - 48);
+    ASSERT_EQ(testflushed[0][1], 48);
+    ASSERT_EQ(testflushed[1][0], 0);
+    ASSERT_EQ(testflushed[1][1], 0x3F0);
+    testfree(p1);
+    testfree(p2);
+    ASSERT_EQ(circ_tail, 0x3F0);
+
+    // TEST 13: Named cursors are stored in batches, and resume after a restart
+    testreset("Named cursors resume where they left off");
+    int c1 = circcursor("tracer");
+    ASSERT_EQ(c1, 0);
+    ASSERT_EQ(circcursor("archiver"), 1);
+    ASSERT_EQ(circcursor("tracer"), c1);
+    ASSERT_EQ(circcursor("tracer-with-a-long-name"), 2);
+    ASSERT_EQ(circcursor("tracer-with-a-long-name"), 2);
+    ASSERT_EQ(circcursor("tracer-with"), 2);      // Truncated to the same name
+    ASSERT_EQ(circcursor("spare"), 3);
+    ASSERT_EQ(circcursor("one-too-many"), -1);
+    pos = circcursorpos(c1);
+    ASSERT_EQ(pos, 0);
+    p1 = testalloc(10);
+    p2 = testalloc(300);
+    p3 = testalloc(8);
+    ASSERT_EQ(circnext(&pos, circ_head), p1);
+    circcursorsave(c1, pos, 0);
+    ASSERT_EQ(circcursorpos(c1), 0);          // Not far enough to be stored
+    ASSERT_EQ(circnext(&pos, circ_head), p2);
+    circcursorsave(c1, pos, 0);
+    ASSERT_EQ(circcursorpos(c1), 0x160);
+    ASSERT_EQ(circnext(&pos, circ_head), p3);
+    circcursorsave(c1, pos, 1);
+    ASSERT_EQ(circcursorpos(c1), 0x170);
+    testfree(p1);
+    testfree(p2);
+    ASSERT_EQ(circcursorpos(circcursor("archiver")), 0x160);  // Behind the tail
+    testfree(p3);
+
+    // TEST 14: Find blocks by sequence number and time using the index
+    testreset("Seek with the sparse index");
+    void *blocks[10];
+    circclock = testclock;
+    for (int i = 0; i < 10; i++) {
+        testnow = 100 * i;
+        blocks[i] = testalloc(8);
+    }
+    circclock = NULL;
+    ASSERT_EQ(circ_idxcount, 3);   // Blocks 0, 4 and 8
+    ASSERT_EQ(circseek(0), blocks[0]);
+    ASSERT_EQ(circseek(5), blocks[5]);
+    ASSERT_EQ(circseek(9), blocks[9]);
+    ASSERT_EQ(circseek(10), NULL);
+    ASSERT_EQ(circseektime(450), blocks[4]);
+    ASSERT_EQ(circseektime(800), blocks[4]);    // Blocks before 8 might be at 800 too
+    ASSERT_EQ(circseektime(801), blocks[8]);
+    ASSERT_EQ(circseektime(2000), blocks[8]);
+    ASSERT_EQ(circseektime(0), NULL);
+    for (int i = 0; i < 5; i++) {
+        testfree(blocks[i]);
+    }
+    ASSERT_EQ(circseek(2), NULL);  // Freed, and the entries for 0 and 4 are gone
+    ASSERT_EQ(circ_idxcount, 1);
+    ASSERT_EQ(circseek(7), NULL);  // Still allocated, but older than the index
+    ASSERT_EQ(circseek(9), blocks[9]);
+
+    testdumplen = 0;
+    circdump(testout);
+    struct dumphdr *dump = (struct dumphdr *)testdumped;
+    ASSERT_EQ(dump->magic, DUMP_MAGIC);
+    ASSERT_EQ(dump->tail, 0x50);
+    ASSERT_EQ(dump->head, 0xA0);
+    ASSERT_EQ(dump->seq, 10);
+    ASSERT_EQ(dump->idxcount, 1);
+    ASSERT_EQ(testdumplen, sizeof(struct dumphdr) + sizeof(circ_cursors) + sizeof(struct idxentry) + 0x50);
+    struct idxentry *entry = (struct idxentry *)(testdumped + sizeof(struct dumphdr) + sizeof(circ_cursors));
+    ASSERT_EQ(entry[0].seq, 8);
+    ASSERT_EQ(entry[0].offset, 0x80);
+    ASSERT_EQ(entry[0].time, 800);
+    for (int i = 5; i < 10; i++) {
+        testfree(blocks[i]);
+    }
+    testreset("Seek by time with equal timestamps");
+    circclock = testclock;
+    for (int i = 0; i < 5; i++) {
+        testnow = i == 0 ? 0 : 100;
+        blocks[i] = testalloc(8);
+    }
+    circclock = NULL;
+    ASSERT_EQ(circseektime(100), blocks[0]);    // Blocks 1-3 are at 100 too
+    ASSERT_EQ(circseektime(101), blocks[4]);
+    for (int i = 0; i < 5; i++) {
+        testfree(blocks[i]);
+    }
+
+    // TEST 15: Decode a dump on several threads, and merge in order
+    testreset("Decode a dump in parallel");
+    circ_head = BUFFSIZE - 48;
+    circ_tail = circ_head;
+    for (int i = 0; i < 10; i++) {
+        blocks[i] = testalloc(i == 1 ? 100 : 8);
+        *(uint32_t *)blocks[i] = i;
+    }
+    testfree(blocks[6]);           // Freed blocks aren't decoded
+    testdumplen = 0;
+    circdump(testout);
+    struct testdecoded decoded[4] = { 0 };
+    void *ctx[4] = { &decoded[0], &decoded[1], &decoded[2], &decoded[3] };
+    ASSERT_EQ(circdumpdecode(testdumped, testdumplen, 4, testdecode, ctx), 3);
+    ASSERT_EQ(decoded[0].count, 4);                  // Until block 4
+    ASSERT_EQ(decoded[1].count, 3);                  // Until block 8
+    ASSERT_EQ(decoded[2].count, 2);
+    ASSERT_EQ(decoded[3].count, 0);
+    int merged = 0;
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < decoded[c].count; i++) {
+            if (merged == 6) merged++;
+            ASSERT_EQ(decoded[c].values[i], merged);
+            merged++;
+        }
+    }
+    ASSERT_EQ(merged, 10);
+    ASSERT_EQ(circdumpdecode(testdumped, 4, 4, testdecode, ctx), -1);
+    ASSERT_EQ(circdumpdecode(testdumped, testdumplen, 0, testdecode, ctx), -1);
+    ((struct dumphdr *)testdumped)->layout.size = 0;
+    ASSERT_EQ(circdumpdecode(testdumped, testdumplen, 4, testdecode, ctx), -1);
+    ((struct dumphdr *)testdumped)->layout.size = BUFFSIZE;
+    ((struct dumphdr *)testdumped)->layout.version--;          // Another `struct hdr`
+    ASSERT_EQ(circdumpdecode(testdumped, testdumplen, 4, testdecode, ctx), -1);
+    ((struct dumphdr *)testdumped)->layout.version++;
+    for (int i = 0; i < 10; i++) {
+        if (i != 6) testfree(blocks[i]);
+    }
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 16: Checkpoint the buffer, and restore it after a restart
+    testreset("Restore from a checkpoint");
+    circ_head = BUFFSIZE - 48;
+    circ_tail = circ_head;
+    for (int i = 0; i < 6; i++) {
+        blocks[i] = testalloc(i == 1 ? 100 : 8);
+        *(uint32_t *)blocks[i] = 0x100 + i;
+    }
+    testfree(blocks[0]);
+    testfree(blocks[3]);           // A free block in the middle
+    c1 = circcursor("tracer");
+    pos = circcursorpos(c1);
+    circnext(&pos, circ_head);
+    circcursorsave(c1, pos, 1);
+    testdumplen = 0;
+    circdump(testout);
+    ASSERT_EQ(circrestore(testdumped, testdumplen - 1), -1);   // Truncated
+    ASSERT_EQ(circ_tail, 0x7E0);
+    struct hdr *dmeta = (struct hdr *)(testdumped + sizeof(struct dumphdr) +
+        sizeof(circ_cursors) + dump->idxcount * sizeof(struct idxentry));
+    uint32_t dlen = dmeta->len;
+    dmeta->len = 0;                // A corrupt block
+    ASSERT_EQ(circrestore(testdumped, testdumplen), -1);
+    dmeta->len = dlen + 0x10;      // Over the end of the buffer
+    ASSERT_EQ(circrestore(testdumped, testdumplen), -1);
+    dmeta->len = dlen;
+    dump->claim = BUFFSIZE;
+    ASSERT_EQ(circrestore(testdumped, testdumplen), -1);
+    dump->claim = circ_claim;
+    struct idxentry *dentry = (struct idxentry *)(testdumped + sizeof(struct dumphdr) +
+                                                  sizeof(circ_cursors));
+    dentry->offset += 8;           // Not at a block
+    ASSERT_EQ(circrestore(testdumped, testdumplen), -1);
+    dentry->offset -= 8;
+    *(uint32_t *)((uint8_t *)dmeta + (testgetoffset(blocks[3]) + BUFFSIZE - circ_tail) % BUFFSIZE) = 0;
+
+    testreset("Restart");
+    for (int i = 0; i < BUFFSIZE; i++) {
+        buffer[i] = 0;
+    }
+    ASSERT_EQ(circrestore(testdumped, testdumplen), 0);
+    ASSERT_EQ(circ_tail, 0x7E0);
+    ASSERT_EQ(circ_head, 0x0B0);
+    ASSERT_EQ(circ_seq, 6);
+    ASSERT_EQ(circseek(5), blocks[5]);
+    ASSERT_EQ(*(uint32_t *)blocks[5], 0x105);
+    ASSERT_EQ(circcursor("tracer"), c1);
+    ASSERT_EQ(circcursorpos(c1), testgetoffset(blocks[2]) - msize);
+    ASSERT_EQ(*(uint32_t *)blocks[3], 0x10);  // The corrupt run is set again
+    for (int i = 1; i < 6; i++) {
+        if (i == 3) continue;
+        ASSERT_EQ(*(uint32_t *)blocks[i], 0x100 + i);
+        testfree(blocks[i]);
+    }
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 17: Restore from a buffer with a different layout
+    testreset("Restore from another layout");
+    for (int i = 0; i < 4; i++) {
+        blocks[i] = testalloc(i == 1 ? 100 : 8);
+        *(uint32_t *)blocks[i] = 0x200 + i;
+    }
+    testfree(blocks[0]);
+    testfree(blocks[2]);
+    c1 = circcursor("tracer");
+    circcursorsave(c1, testgetoffset(blocks[2]) - msize, 1);
+    circ_claim = testgetoffset(blocks[3]) - msize;
+    testdumplen = 0;
+    circdump(testout);
+    dump = (struct dumphdr *)testdumped;
+    ASSERT_EQ(dump->tail, 0x10);
+    ASSERT_EQ(dump->layout.version, LAYOUT_VERSION);
+    ASSERT_EQ(circlayoutcheck(&dump->layout), LAYOUT_SAME);
+    dump->layout.version++;
+    ASSERT_EQ(circlayoutcheck(&dump->layout), LAYOUT_INCOMPATIBLE);
+    ASSERT_EQ(circrestore(testdumped, testdumplen), -1);
+    dump->layout.version--;
+    dump->layout.size = 2 * BUFFSIZE;
+    ASSERT_EQ(circlayoutcheck(&dump->layout), LAYOUT_REPACK);
+
+    testreset("Restart with a new size");
+    ASSERT_EQ(circrestore(testdumped, testdumplen), 0);
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circ_head, 0x80);    // The freed block isn't copied
+    ASSERT_EQ(*(uint32_t *)(buffer + msize), 0x201);
+    ASSERT_EQ(*(uint32_t *)(buffer + 0x70 + msize), 0x203);
+    ASSERT_EQ(circcursorpos(circcursor("tracer")), 0x70); // Moved to the next block
+    ASSERT_EQ(circ_claim, 0x70);
+    testfree(buffer + msize);
+    testfree(buffer + 0x70 + msize);
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 18: Read from a pipe and a socket directly into blocks
+    testreset("Read directly into blocks");
+    int fds[2];
+    ssize_t len;
+    ASSERT_EQ(pipe(fds), 0);
+    ASSERT_EQ(write(fds[1], "hello", 5), 5);
+    p1 = circread(fds[0], 100, &len);
+    ASSERT_EQ(len, 5);
+    ASSERT_EQ(circ_head, 0x10);    // Trimmed from 0x70 to what was read
+    ASSERT_EQ(((char *)p1)[4], 'o');
+    p2 = testalloc(8);
+    ASSERT_EQ(circtrim(p1, 1), -1);           // Not the newest block
+    ASSERT_EQ(circtrim(p2, 20), -1);          // Can't grow
+    ASSERT_EQ(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+    ASSERT_EQ(circread(fds[0], 100, &len), NULL);
+    ASSERT_EQ(len, -1);
+    ASSERT_EQ(errno, EAGAIN);
+    ASSERT_EQ(circ_head, 0x20);    // Taken back, not freed
+    ASSERT_EQ(circ_seq, 2);
+    close(fds[1]);
+    ASSERT_EQ(circread(fds[0], 100, &len), NULL);
+    ASSERT_EQ(len, 0);             // End of file
+    ASSERT_EQ(circ_head, 0x20);
+    close(fds[0]);
+    ASSERT_EQ(circread(-1, 100, &len), NULL);
+    ASSERT_EQ(len, -1);
+    ASSERT_EQ(circread(0, BUFFSIZE, &len), NULL);
+    ASSERT_EQ(errno, ENOBUFS);
+    struct poller reader = { .cursor = circ_tail, .spins = 100 };
+    int consumed = 0;
+    while (circpoll(&reader, testhandle, &consumed) > 0);
+    ASSERT_EQ(consumed, 2);        // Only the blocks that were read into
+    ASSERT_EQ(circ_tail, 0x20);
+    ASSERT_EQ(circ_head, 0x20);
+
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+    ASSERT_EQ(send(fds[1], "datagram", 8, 0), 8);
+    struct msghdr msg = { 0 };
+    p1 = circrecvmsg(fds[0], 1000, &msg, 0, &len);
+    ASSERT_EQ(len, 8);
+    ASSERT_EQ(circ_head, 0x30);
+    ASSERT_EQ(((char *)p1)[7], 'm');
+    ASSERT_EQ(send(fds[1], "a longer datagram", 17, 0), 17);
+    p2 = circrecvmsg(fds[0], 8, &msg, MSG_TRUNC, &len);
+    ASSERT_EQ(len, 8);             // Not the 17 bytes `recvmsg()` returns
+    ASSERT_NE(msg.msg_flags & MSG_TRUNC, 0);
+    ASSERT_EQ(circ_head, 0x40);
+    close(fds[0]);
+    close(fds[1]);
+    testfree(p1);
+    testfree(p2);
+    ASSERT_EQ(circ_tail, 0x40);
+    circ_head = BUFFSIZE - 0x20;
+    circ_tail = circ_head;
+    ASSERT_EQ(circread(-1, 100, &len), NULL);  // After a gap, so freed instead
+    ASSERT_EQ(circ_tail, 0x70);
+    ASSERT_EQ(circ_head, 0x70);
+    ASSERT_EQ(circ_seq, 4);
+
+    // TEST 19: Deferred frees wait for all readers to be quiescent
+    testreset("Deferred free after a grace period");
+    p1 = testalloc(10);
+    p2 = testalloc(8);
+    ASSERT_EQ(circfree_deferred(p1), 0);      // No readers, freed now
+    ASSERT_EQ(circ_tail, 0x20);
+    int r1 = circreader();
+    int r2 = circreader();
+    ASSERT_EQ(r1, 0);
+    ASSERT_EQ(r2, 1);
+    ASSERT_EQ(circfree_deferred(p2), 0);
+    ASSERT_EQ(circ_tail, 0x20);    // Both readers might still see it
+    circquiescent(r1);
+    ASSERT_EQ(circreclaim(), 0);
+    ASSERT_EQ(circ_tail, 0x20);    // r2 might still see it
+    circquiescent(r2);
+    ASSERT_EQ(circreclaim(), 1);
+    ASSERT_EQ(circ_tail, 0x30);
+    for (int i = 0; i < DEFER_MAX; i++) {
+        blocks[0] = testalloc(8);
+        ASSERT_EQ(circfree_deferred(blocks[0]), 0);
+    }
+    p1 = testalloc(8);
+    ASSERT_EQ(circfree_deferred(p1), -1);     // Full, waiting for the readers
+    circreaderdone(r1);
+    ASSERT_EQ(circfree_deferred(p1), -1);     // Still waiting for r2
+    circquiescent(r2);
+    ASSERT_EQ(circfree_deferred(p1), 0);      // All but p1 are freed now
+    ASSERT_EQ(circ_defercount, 1);
+    circreaderdone(r2);
+    ASSERT_EQ(circreclaim(), 1);
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 20: Consume a snapshot in bulk, and release it at once
+    testreset("Release a snapshot without freeing");
+    circ_head = BUFFSIZE - 48;
+    circ_tail = circ_head;
+    circ_claim = circ_head;
+    p1 = testalloc(10);
+    p2 = testalloc(200);
+    p3 = testalloc(8);
+    uint32_t snap = circsnapshot();
+    ASSERT_EQ(snap, 0xE0);
+    p4 = testalloc(20);            // The producer continues
+    pos = circ_tail;
+    ASSERT_EQ(circnext(&pos, snap), p1);
+    ASSERT_EQ(circnext(&pos, snap), p2);
+    ASSERT_EQ(circnext(&pos, snap), p3);
+    ASSERT_EQ(circnext(&pos, snap), NULL);
+    circsnaprelease(snap);
+    ASSERT_EQ(circ_tail, 0xE0);
+    ASSERT_EQ(circ_claim, 0xE0);   // Moved with the tail
+    ASSERT_EQ(circnext(&circ_claim, circ_head), p4);
+    testfree(p4);
+    ASSERT_EQ(circ_tail, circ_head);
+    struct reservation snapresv;
+    p1 = testalloc(8);
+    ASSERT_EQ(circreserve(&snapresv, 2 * CIRC_BLOCKSIZE(8)), 0);
+    p2 = testalloc(8);
+    snap = circsnapshot();
+    ASSERT_EQ(snap, testgetoffset(p1) - msize + 0x10);     // Ends at the reservation
+    pos = circ_tail;
+    ASSERT_EQ(circnext(&pos, snap), p1);
+    ASSERT_EQ(circnext(&pos, snap), NULL);
+    circsnaprelease(snap);
+    ASSERT_EQ(circ_tail, snap);
+    p3 = circresalloc(&snapresv, 8);       // Still owned by the producer
+    circresrelease(&snapresv);
+    ASSERT_EQ(circnext(&pos, circ_head), p3);
+    ASSERT_EQ(circnext(&pos, circ_head), p2);
+    testfree(p3);
+    testfree(p2);
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 21: Profile who uses the buffer
+    testreset("Export a heap profile");
+    circ_profilerate = 2;
+    for (int i = 0; i < 4; i++) {
+        blocks[i] = testalloc(8);
+    }
+    blocks[4] = circalloc(40);     // A different call site
+    blocks[5] = circalloc(40);
+    ASSERT_EQ(circ_nsites, 2);
+    ASSERT_EQ(((struct hdr *)(blocks[0] - msize))->site, 1);
+    ASSERT_EQ(((struct hdr *)(blocks[1] - msize))->site, 0);
+    ASSERT_EQ(((struct hdr *)(blocks[4] - msize))->site, 2);
+    testfree(blocks[2]);
+    testdumplen = 0;
+    circprofile(testout);
+    ASSERT_EQ(testdumped[0], 0x0A);          // sample_type
+    // The first sample is from `testalloc`: 1 object sampled of 16 bytes.
+    ASSERT_EQ(testdumped[12], 0x12);         // sample
+    ASSERT_EQ(testdumped[14], 0x0A);         // location_id
+    ASSERT_EQ(testdumped[16], 1);
+    ASSERT_EQ(testdumped[17], 0x12);         // value
+    ASSERT_EQ(testdumped[18], 2);
+    ASSERT_EQ(testdumped[19], 2);            // inuse_objects
+    ASSERT_EQ(testdumped[20], 32);           // inuse_space
+    for (int i = 0; i < 6; i++) {
+        if (i != 2) testfree(blocks[i]);
+    }
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 22: Export the counters as OpenMetrics
+    testreset("Export metrics");
+    char metrics[2048];
+    circ_head = BUFFSIZE - 48;
+    circ_tail = circ_head;
+    p1 = testalloc(10);
+    p2 = testalloc(1000);          // Wraps, losing 16 bytes
+    p3 = testalloc(2000);          // Fails
+    p3 = testalloc(8);
+    testfree(p2);
+    testfree(p3);
+    testfree(p1);                  // Reclaims p1, and p2 merged with p3
+    ASSERT_EQ(circmetrics(metrics, 100, "test"), -1);
+    ASSERT_GT(circmetrics(metrics, sizeof(metrics), "test"), 0);
+    printf("%s", metrics);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_used_bytes{pool=\"test\"} 0\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_peak_bytes{pool=\"test\"} 1072\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_allocs_total{pool=\"test\"} 3\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_alloc_failures_total{pool=\"test\"} 1\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_gap_bytes_total{pool=\"test\"} 16\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_free_walk_blocks_bucket{pool=\"test\",le=\"0\"} 2\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_free_walk_blocks_bucket{pool=\"test\",le=\"1\"} 2\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_free_walk_blocks_bucket{pool=\"test\",le=\"2\"} 3\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\ncircalloc_free_walk_blocks_sum{pool=\"test\"} 2\n"), NULL);
+    ASSERT_NE(strstr(metrics, "\n# EOF\n"), NULL);
+
+    // TEST 23: Reserve capacity for a burst of blocks
+    testreset("Reserve capacity");
+    struct reservation resv;
+    p1 = testalloc(8);
+    ASSERT_EQ(circreserve(&resv, 3 * CIRC_BLOCKSIZE(40)), 0);
+    ASSERT_EQ(circ_head, 0xA0);
+    p2 = testalloc(8);             // Allocated after the reservation
+    pos = circ_tail;
+    ASSERT_EQ(circnext(&pos, circ_head), p1);
+    ASSERT_EQ(circnext(&pos, circ_head), NULL); // Waits for the reservation
+    p3 = circresalloc(&resv, 40);
+    ASSERT_EQ(p3, buffer + 0x10 + msize);
+    p4 = circresalloc(&resv, 40);
+    ASSERT_EQ(circ_seq, 2);        // Only blocks from `circalloc` are numbered
+    ASSERT_EQ(circnext(&pos, circ_head), p3);
+    ASSERT_EQ(circnext(&pos, circ_head), p4);
+    ASSERT_EQ(circnext(&pos, circ_head), NULL);
+    circresrelease(&resv);
+    ASSERT_EQ(circ_head, 0xB0);    // Not at the head, so freed instead
+    ASSERT_EQ(circnext(&pos, circ_head), p2);
+    ASSERT_EQ(circnext(&pos, circ_head), NULL);
+    testfree(p1);
+    testfree(p3);
+    testfree(p4);
+    ASSERT_EQ(circ_tail, 0xA0);    // Reclaimed the rest of the reservation
+    testfree(p2);
+    ASSERT_EQ(circ_tail, circ_head);
+    ASSERT_EQ(circreserve(&resv, 64), 0);
+    p1 = circresalloc(&resv, 8);
+    circresrelease(&resv);
+    ASSERT_EQ(circ_head, 0xC0);    // The rest goes back to the head
+    testfree(p1);
+    ASSERT_EQ(circ_tail, circ_head);
+    ASSERT_EQ(circreserve(&resv, BUFFSIZE), -1);
+    ASSERT_EQ(circreserve(&resv, UINT32_MAX - 8), -1);     // Doesn't wrap to 0x10
+    ASSERT_EQ(circalloc(UINT32_MAX - 7), NULL);
+    ASSERT_EQ(circ_head, circ_tail);
+    ASSERT_EQ(circreserve(&resv, 2 * CIRC_BLOCKSIZE(8)), 0);
+    p1 = circresalloc(&resv, 8);
+    p2 = circresalloc(&resv, 8);
+    testfree(p2);
+    testdumplen = 0;
+    circprofile(testout);          // Skips the freed block and stops at the head
+    ASSERT_GT(testdumplen, 0);
+    testfree(p1);
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 24: Coalesce small records into one block
+    testreset("Coalesce records");
+    struct coalescer co = { .delay = 50 };
+    uint32_t reclen;
+    circclock = testclock;
+    testnow = 0;
+    ASSERT_EQ(circcoalesce(&co, "a", 1), 0);
+    ASSERT_EQ(circcoalesce(&co, "bcdef", 5), 0);
+    ASSERT_EQ(circ_head, COALESCE_SIZE);
+    pos = circ_tail;
+    ASSERT_EQ(circnext(&pos, circ_head), NULL); // Not published yet
+    testnow = 49;
+    ASSERT_EQ(circcoalpoll(&co), NULL);
+    testnow = 50;
+    p1 = circcoalpoll(&co);
+    ASSERT_EQ(p1, buffer + msize);
+    ASSERT_EQ(circ_head, 0x20);    // Shrunk to the records
+    ASSERT_EQ(circnext(&pos, circ_head), p1);
+    pos = 0;
+    p2 = circrecord(p1, &pos, &reclen);
+    ASSERT_EQ(reclen, 1);
+    ASSERT_EQ(memcmp(p2, "a", 1), 0);
+    p2 = circrecord(p1, &pos, &reclen);
+    ASSERT_EQ(reclen, 5);
+    ASSERT_EQ(memcmp(p2, "bcdef", 5), 0);
+    ASSERT_EQ(circrecord(p1, &pos, &reclen), NULL);
+    char rec[100] = { 0 };
+    ASSERT_EQ(circcoalesce(&co, rec, sizeof(rec)), 0);
+    ASSERT_EQ(circcoalesce(&co, rec, sizeof(rec)), 0);
+    ASSERT_EQ(circcoalesce(&co, rec, sizeof(rec)), 0);     // Full, so published
+    ASSERT_EQ(circ_head, 0x20 + 0xE0 + COALESCE_SIZE);
+    p2 = buffer + 0x20 + msize;
+    ASSERT_EQ(*(uint32_t *)p2, 2 * (sizeof(uint32_t) + sizeof(rec)));
+    p3 = circcoalflush(&co);
+    ASSERT_EQ(circcoalflush(&co), NULL);
+    testfree(p1);
+    testfree(p2);
+    testfree(p3);
+    ASSERT_EQ(circ_tail, circ_head);
+    circclock = NULL;
+
+    // TEST 25: Poll for blocks, spinning only while they keep coming
+    testreset("Poll adaptively");
+    struct poller poller = { .cursor = circ_tail, .spins = 2 };
+    int handled = 0;
+    for (int i = 0; i < 8; i++) {
+        testalloc(8);
+    }
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 1);
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 2);
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 4);
+    ASSERT_EQ(poller.batch, 8);
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 1);
+    ASSERT_EQ(poller.batch, 4);    // Less than half full
+    ASSERT_EQ(handled, 8);
+    ASSERT_EQ(circ_tail, circ_head);
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 0);
+    ASSERT_EQ(poller.sleeps, 0);   // Still spinning
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 0);
+    ASSERT_EQ(poller.sleeps, 1);   // Nobody woke it, so it timed out
+    ASSERT_EQ(poller.wakes, 0);
+    circwake(&poller);             // Not sleeping, so does nothing
+    ASSERT_EQ(poller.wake, 0);
+    ASSERT_EQ(poller.polls, 6);
+    ASSERT_EQ(poller.blocks, 8);
+    p1 = testalloc(8);
+    ASSERT_EQ(circreserve(&resv, 64), 0);     // Like an open coalescer
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 1);
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 0);
+    ASSERT_EQ(circpoll(&poller, testhandle, &handled), 0);
+    ASSERT_EQ(poller.sleeps, 2);   // Waits at the reservation instead of spinning
+    circresrelease(&resv);
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 26: Read tagged blocks through typed views
+    testreset("Typed views");
+    p1 = trade_alloc();
+    trade_set_time(p1, 1234567890123);
+    trade_set_side(p1, 'B');
+    trade_set_price(p1, 9950);
+    trade_set_quantity(p1, 300);
+    memcpy(trade_symbol(p1), "ACME", 5);
+    p2 = quote_alloc();
+    p3 = testalloc(8);             // Untagged
+    ASSERT_EQ(circ_head, CIRC_BLOCKSIZE(TRADE_SIZE) + CIRC_BLOCKSIZE(QUOTE_SIZE) + 0x10);
+    ASSERT_EQ(circschema(p1), TRADE_SCHEMA);
+    ASSERT_EQ(circschema(p3), 0);
+    ASSERT_EQ(trade_view(p1), p1);
+    ASSERT_EQ(trade_view(p2), NULL);
+    ASSERT_EQ(quote_view(p3), NULL);
+    ASSERT_EQ(trade_time(p1), 1234567890123);
+    ASSERT_EQ(trade_side(p1), 'B');
+    ASSERT_EQ(trade_price(p1), 9950);
+    ASSERT_EQ(trade_quantity(p1), 300);
+    ASSERT_EQ(strcmp(trade_symbol(p1), "ACME"), 0);
+    ASSERT_EQ(*(uint32_t *)((uint8_t *)p1 + 12), 9950);    // Read in place
+    testfree(p1);
+    testfree(p2);
+    testfree(p3);
+
+    // TEST 27: Merge freed blocks, so the tail passes them in one step
+    testreset("Merge free blocks");
+    for (int i = 0; i < 6; i++) {
+        blocks[i] = testalloc(8);
+    }
+    testfree(blocks[3]);
+    testfree(blocks[2]);           // Merged with the block after
+    ASSERT_EQ(*(uint32_t *)blocks[2], 0x20);
+    ASSERT_EQ(((struct hdr *)(blocks[2] - msize))->len, 0x10);  // Left as it was
+    testfree(blocks[4]);           // Merged with the block freed before
+    ASSERT_EQ(*(uint32_t *)blocks[2], 0x30);
+    ASSERT_EQ(circ_freehint, 0x20);
+    testfree(blocks[1]);
+    ASSERT_EQ(*(uint32_t *)blocks[1], 0x40);
+    pos = 0x30;                    // A cursor at a merged block still works
+    ASSERT_EQ(circnext(&pos, circ_head), blocks[5]);
+    ASSERT_EQ(pos, 0x60);
+    pos = 0x10;
+    ASSERT_EQ(circnext(&pos, circ_head), blocks[5]);
+    testfree(blocks[0]);
+    ASSERT_EQ(circ_tail, 0x50);
+    ASSERT_EQ(circ_stats.walked, 2); // Two blocks instead of five
+    ASSERT_EQ(circ_freehint, UINT32_MAX);
+    testfree(blocks[5]);
+    ASSERT_EQ(circ_tail, circ_head);
+    testreset("Seek past merged blocks");
+    for (int i = 0; i < 10; i++) {
+        blocks[i] = testalloc(8);
+    }
+    testfree(blocks[5]);
+    testfree(blocks[6]);
+    ASSERT_EQ(circseek(7), blocks[7]);
+    ASSERT_EQ(circseek(9), blocks[9]);
+    for (int i = 0; i < 10; i++) {
+        if (i != 5 && i != 6) testfree(blocks[i]);
+    }
+    ASSERT_EQ(circ_tail, circ_head);
+
+    // TEST 28: Reuse the buffer for a new session
+    testreset("Reset for reuse");
+    ASSERT_EQ(circcursor("session"), 0);
+    p1 = testalloc(100);
+    p2 = testalloc(8);
+    circcursorsave(0, 0x80, 1);
+    testfree(p2);                  // Leaves a hint
+    ASSERT_EQ(circreader(), 0);
+    circreset();
+    ASSERT_EQ(circ_head, 0);
+    ASSERT_EQ(circ_tail, 0);
+    ASSERT_EQ(circavail(), BUFFSIZE);
+    ASSERT_EQ(circ_freehint, UINT32_MAX);
+    ASSERT_EQ(circ_idxcount, 0);
+    ASSERT_EQ(circ_stats.allocs, 0);
+    ASSERT_EQ(circcursor("other"), 0);         // The old cursors are gone
+    ASSERT_EQ(circcursor("other"), 0);
+    ASSERT_EQ(strcmp(circ_cursors[0].name, "other"), 0);
+    ASSERT_EQ(circreader(), 0);
+    ASSERT_EQ(testalloc(8), p1);
+
+    // TEST 29: Drain the buffer before reconfiguring it
+    testreset("Quiesce");
+    p1 = testalloc(8);
+    p2 = testalloc(8);
+    ASSERT_EQ(circquiesce(100), 2);    // No clock, so doesn't wait
+    ASSERT_EQ(circ_draining, 1);
+    ASSERT_EQ(circalloc(8), NULL);     // Fails fast
+    ASSERT_EQ(circalloc(BUFFSIZE), NULL);
+    ASSERT_EQ(circreserve(&resv, 64), -1);
+    ASSERT_EQ(circ_stats.failures, 3);
+    testfree(p1);
+    circclock = testclock;
+    testnow = 100;
+    ASSERT_EQ(circquiesce(100), 1);    // The deadline passed
+    ASSERT_EQ(circfree_deferred(p2), 0);
+    ASSERT_EQ(circquiesce(200), 0);    // Reclaimed while waiting
+    ASSERT_EQ(circ_tail, circ_head);
+    circresume();
+    p1 = testalloc(8);
+    ASSERT_NE(p1, NULL);
+    circquiesce(0);
+    circreset();                       // Also ends draining
+    ASSERT_EQ(circ_draining, 0);
+    circclock = NULL;
 
     return 0;
 }
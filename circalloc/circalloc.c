@@ -0,0 +1,1360 @@
+#include "circalloc.h"
+
+uint32_t circ_head;
+uint32_t circ_tail;
+uint32_t circ_claim;
+uint32_t circ_freehint = UINT32_MAX;
+uint8_t circ_draining;
+uint32_t circ_synced;
+struct cursor circ_cursors[CURSOR_MAX];
+
+uint32_t circ_epoch;
+uint32_t circ_readers[READER_MAX];
+uint8_t circ_reading[READER_MAX];
+void *circ_deferred[DEFER_MAX];
+uint32_t circ_deferepoch[DEFER_MAX];
+uint32_t circ_deferfirst;
+uint32_t circ_defercount;
+
+uint32_t circ_seq;
+struct idxentry circ_blockindex[INDEX_MAX];
+uint32_t circ_idxfirst;
+uint32_t circ_idxcount;
+uint64_t (*circclock)(void);
+
+struct stats circ_stats;
+uint32_t circ_profilerate;
+uintptr_t circ_sites[SITE_MAX];
+uint16_t circ_nsites;
+
+void (*circassert)(const char *expr, const char *file, int line);
+
+uint32_t circavail(void)
+{
+    return circ_head >= circ_tail ?
+        BUFFSIZE - circ_head + circ_tail :
+        circ_tail - circ_head;
+}
+
+// Stop allocating, and wait until all blocks are freed or `circclock()` reaches
+// `deadline`, e.g. before resetting or reconfiguring the buffer. Allocations
+// fail until `circresume()`, but blocks can still be allocated from existing
+// reservations. Deferred frees are reclaimed while waiting. Without a clock,
+// there's no waiting. Returns the number of blocks still in use.
+//
+// Like `circalloc`, this isn't lockless yet. When producers run on other
+// threads, `circ_draining` must be set atomically.
+int circquiesce(uint64_t deadline)
+{
+    struct hdr *meta;
+    int count = 0;
+
+    circ_draining = 1;
+    while (circ_head != circ_tail && circclock && circclock() < deadline) {
+        circreclaim();
+    }
+
+    for (uint32_t offset = circ_tail; offset != circ_head;
+         offset = (offset + meta->len) % BUFFSIZE) {
+        meta = (struct hdr *)(buffer + offset);
+        if (meta->free != HDR_FREE && meta->free != HDR_GAP) count++;
+    }
+    return count;
+}
+
+// Allow allocations again after `circquiesce()`.
+void circresume(void)
+{
+    circ_draining = 0;
+}
+
+// Forget all blocks, cursors, readers and counters, e.g. to reuse the buffer
+// for a new session instead of setting up a new one. The memory isn't touched,
+// so it stays mapped and warm. The hooks and the profile rate are kept.
+void circreset(void)
+{
+    circ_head = 0;
+    circ_tail = 0;
+    circ_claim = 0;
+    circ_synced = 0;
+    circ_freehint = UINT32_MAX;
+    circ_draining = 0;
+    for (int c = 0; c < CURSOR_MAX; c++) {
+        for (int i = 0; i < CURSOR_NAMELEN; i++) {
+            circ_cursors[c].name[i] = 0;
+        }
+    }
+    circ_seq = 0;
+    circ_idxfirst = 0;
+    circ_idxcount = 0;
+    for (int r = 0; r < READER_MAX; r++) {
+        circ_reading[r] = 0;
+    }
+    circ_deferfirst = 0;
+    circ_defercount = 0;
+    circ_nsites = 0;
+    circ_stats = (struct stats){ 0 };
+}
+
+static void circallocblock(uint32_t size, uint8_t hdr_free)
+{
+    if (size == 0) return;
+    struct hdr *meta;
+    meta = (struct hdr *)(buffer + circ_head);
+    meta->free = hdr_free;
+    meta->flags = 0;
+    meta->site = 0;
+    meta->schema = 0;
+    meta->len = size;
+    circ_head = (circ_head + size) % BUFFSIZE;
+}
+
+// Drop the index entries for blocks the tail has passed. This is done before
+// the head moves, else a new block could reuse the offset of a dropped one.
+static void circindexprune(void)
+{
+    uint32_t used = (circ_head + BUFFSIZE - circ_tail) % BUFFSIZE;
+    while (circ_idxcount > 0 &&
+           (circ_blockindex[circ_idxfirst].offset + BUFFSIZE - circ_tail) % BUFFSIZE >= used) {
+        circ_idxfirst = (circ_idxfirst + 1) % INDEX_MAX;
+        circ_idxcount--;
+    }
+}
+
+static void circindexadd(uint32_t offset)
+{
+    struct idxentry *entry;
+
+    if (circ_idxcount == INDEX_MAX) {
+        circ_idxfirst = (circ_idxfirst + 1) % INDEX_MAX;
+        circ_idxcount--;
+    }
+    entry = &circ_blockindex[(circ_idxfirst + circ_idxcount) % INDEX_MAX];
+    entry->seq = circ_seq;
+    entry->offset = offset;
+    entry->time = circclock ? circclock() : 0;
+    circ_idxcount++;
+}
+
+// Get the site for the return address `pc`, adding it if it's new. Returns
+// zero if the table is full.
+static uint8_t circsite(void *pc)
+{
+    for (uint16_t i = 0; i < circ_nsites; i++) {
+        if (circ_sites[i] == (uintptr_t)pc) return i + 1;
+    }
+    if (circ_nsites == SITE_MAX) return 0;
+    circ_sites[circ_nsites++] = (uintptr_t)pc;
+    return circ_nsites;
+}
+
+// The complete allocation, see `circalloc()` for the common case.
+void *circallocslow(uint32_t size)
+{
+    int offset = circ_head;
+    int rem = 0;
+
+    // Ensure additional memory for our header, which is always at the
+    // beginning. The total size is aligned to 16 bytes. That means every time
+    // we allocate, the start of the buffer is always aligned to 16 bytes.
+    int block_size = CIRC_BLOCKSIZE(size);
+
+    // The block size wraps for the largest sizes, so check the size itself.
+    if (circ_draining || size >= BUFFSIZE) {
+        circ_stats.failures++;
+        return NULL;
+    }
+
+    // Take into account that we might want to wrap. So if the head > tail, and
+    // we allocate more than what there is at the end, we need to ignore the end
+    // by allocating an extra chunk.
+    if (circ_head >= circ_tail && (BUFFSIZE - circ_head < block_size)) {
+        rem = BUFFSIZE - circ_head; // We know this is already aligned
+        offset = 0;
+    }
+
+    // Not enough memory. Note the equals, so that head == tail is empty is
+    // preserved.
+    if (circavail() <= block_size + rem) {
+        circ_stats.failures++;
+        return NULL;
+    }
+
+    // Doing this lockless is not yet considered. `circalloc` and `circfree` may
+    // all be called simultaneously, so the `meta`, `circ_head`, `circ_tail`
+    // must all be set atomically.
+    circindexprune();
+    if (circ_seq % INDEX_EVERY == 0) circindexadd(offset);
+    int sampled = circ_profilerate && circ_seq % circ_profilerate == 0;
+    circ_seq++;
+
+    circallocblock(rem, HDR_GAP);
+    circallocblock(block_size, HDR_INUSE);
+    if (sampled) {
+        ((struct hdr *)(buffer + offset))->site = circsite(__builtin_return_address(0));
+    }
+
+    circ_stats.allocs++;
+    circ_stats.gapbytes += rem;
+    if (BUFFSIZE - circavail() > circ_stats.peak) circ_stats.peak = BUFFSIZE - circavail();
+    return buffer + offset + sizeof(struct hdr);
+}
+
+static void circstatfree(uint32_t walked)
+{
+    int bucket = 0;
+    while (bucket < WALK_BUCKETS - 1 && walked > (1u << bucket >> 1)) bucket++;
+    circ_stats.frees++;
+    circ_stats.walks[bucket]++;
+    circ_stats.walked += walked;
+}
+
+// The bytes of free blocks starting with the free block `meta`, which the
+// tail passes in one step. It's kept in the payload, which isn't used anymore,
+// so that the header stays as it was.
+static uint32_t *circrun(struct hdr *meta)
+{
+    return (uint32_t *)((uint8_t *)meta + sizeof(struct hdr));
+}
+
+// Move `pos` to the tail if the tail moved past it, coming from `from`, so
+// that positions kept across frees never point at reclaimed memory.
+static void circpassed(uint32_t *pos, uint32_t from)
+{
+    if ((*pos + BUFFSIZE - from) % BUFFSIZE < (circ_tail + BUFFSIZE - from) % BUFFSIZE) {
+        *pos = circ_tail;
+    }
+}
+
+// Move the tail past all freed blocks. Returns the number of blocks reclaimed.
+static uint32_t circwalktail(void)
+{
+    struct hdr *meta;
+    struct hdr *gmeta = NULL;
+    uint32_t walked = 0;
+    uint32_t from;
+
+    // If there is corruption in the structure, this might result in an infinite
+    // loop.
+    meta = (struct hdr *)(buffer + circ_tail);
+    while (circ_head != circ_tail) {
+        switch(meta->free) {
+        case HDR_INUSE:
+        case HDR_DONE:
+        case HDR_COMMIT:
+        case HDR_RESERVED:
+            return walked;
+        case HDR_GAP:
+            // To know if this is free, we need to find the next element. It is
+            // an error to have to HDR_GAP after each other, or no other buffer
+            // at all. This is special, because the user will never pass the
+            // pointer to this block when freeing (as the user never knows about
+            // it).
+            gmeta = meta;
+            int gtail = (circ_tail + gmeta->len) % BUFFSIZE;
+            meta = (struct hdr *)(buffer + gtail);
+            break;
+        case HDR_FREE:
+            CIRC_ASSERT(meta->len != 0);
+            from = circ_tail;
+            if (gmeta) circ_tail = (circ_tail + gmeta->len) % BUFFSIZE;
+            circ_tail = (circ_tail + *circrun(meta)) % BUFFSIZE;
+            circpassed(&circ_claim, from);
+            circpassed(&circ_synced, from);
+            gmeta = NULL;
+            meta = (struct hdr *)(buffer + circ_tail);
+            walked++;
+            circ_freehint = UINT32_MAX;
+            break;
+        }
+    }
+    return walked;
+}
+
+// Merge the run of the free block at `offset` with the runs right after it,
+// and with the run of the block freed last if it's right before it, so that the
+// tail passes all of them in one step. Runs never go over the end of the
+// buffer or the head. Only the run length in the payload changes, every block
+// keeps its header, so cursors and `circseek()` still see each block. Returns
+// the offset of the merged run.
+static uint32_t circmerge(uint32_t offset)
+{
+    struct hdr *meta = (struct hdr *)(buffer + offset);
+    struct hdr *next;
+    struct hdr *prev;
+    uint32_t end;
+
+    for (;;) {
+        end = offset + *circrun(meta);
+        if (end == BUFFSIZE || end == circ_head) break;
+        next = (struct hdr *)(buffer + end);
+        if (next->free != HDR_FREE || next->flags != meta->flags) break;
+        *circrun(meta) += *circrun(next);
+    }
+
+    if (circ_freehint != UINT32_MAX &&
+        (circ_freehint + BUFFSIZE - circ_tail) % BUFFSIZE <
+        (circ_head + BUFFSIZE - circ_tail) % BUFFSIZE) {
+        prev = (struct hdr *)(buffer + circ_freehint);
+        if (prev->free == HDR_FREE && prev->flags == meta->flags &&
+            circ_freehint + *circrun(prev) == offset) {
+            *circrun(prev) += *circrun(meta);
+            offset = circ_freehint;
+        }
+    }
+    return offset;
+}
+
+void circfree(void *addr)
+{
+    struct hdr *meta;
+    uint32_t offset;
+    meta = (struct hdr *)(addr - sizeof(struct hdr));
+    offset = (uint8_t *)meta - buffer;
+
+    // Mark this block as free. It might not be the tail, and might be somewhere
+    // in the middle. If it's the head, we don't allow that memory yet to be
+    // reclaimed until the tail catches up.
+    CIRC_ASSERT(meta->free != HDR_FREE && meta->free != HDR_GAP);
+    CIRC_ASSERT(meta->free != HDR_COMMIT);     // Not durable yet
+    meta->free = HDR_FREE;
+    *circrun(meta) = meta->len;
+    if (offset != circ_tail) circ_freehint = circmerge(offset);
+    circstatfree(circwalktail());
+}
+
+// Return the block at `cursor` and move the cursor to the next block, or NULL if
+// the cursor has reached `limit`. The user never sees gap blocks or the unused
+// rest of reservations, so they're skipped here. A reservation still in use is
+// like the limit, as blocks are still allocated from it, and so is a committed
+// block, which may only be used once it's synced. Blocks freed by their
+// producer are still returned, so that `circseek()` can count them.
+static void *circnextblock(uint32_t *cursor, uint32_t limit)
+{
+    struct hdr *meta;
+    uint32_t offset;
+
+    for (;;) {
+        if (*cursor == limit) return NULL;
+        meta = (struct hdr *)(buffer + *cursor);
+        if (meta->free == HDR_RESERVED || meta->free == HDR_COMMIT) return NULL;
+        if (meta->free != HDR_GAP &&
+            !(meta->free == HDR_FREE && meta->flags & HDR_TOKEN)) break;
+        *cursor = (*cursor + meta->len) % BUFFSIZE;
+    }
+    offset = *cursor;
+    *cursor = (*cursor + meta->len) % BUFFSIZE;
+    return buffer + offset + sizeof(struct hdr);
+}
+
+// Return the next block for a consumer at `cursor` and move the cursor past it,
+// or NULL if the cursor has reached `limit`. The limit is `circ_head`, or the
+// cursor of another consumer that this one may not overtake. Blocks already
+// freed, e.g. abandoned by their producer, are skipped.
+void *circnext(uint32_t *cursor, uint32_t limit)
+{
+    void *p;
+
+    do {
+        p = circnextblock(cursor, limit);
+    } while (p != NULL && ((struct hdr *)(p - sizeof(struct hdr)))->free == HDR_FREE);
+    return p;
+}
+
+// Get the block that stage `stage` of a pipeline processes next, without moving
+// its cursor. Every stage works on the blocks in place and has its own cursor
+// in `cursors`. Stage 0 follows `circ_head`, every other stage may only see the
+// blocks the previous stage is done with.
+void *circstage(uint32_t *cursors, int stage)
+{
+    uint32_t cursor = cursors[stage];
+    return circnext(&cursor, stage == 0 ? circ_head : cursors[stage - 1]);
+}
+
+// Stage `stage` is done with its current block, making it visible to the next
+// stage. The last stage calls this before freeing the block with `circfree()`.
+void circstagedone(uint32_t *cursors, int stage)
+{
+    circnext(&cursors[stage], stage == 0 ? circ_head : cursors[stage - 1]);
+}
+
+// Mark a block as processed. It is freed by `circemit()` once all blocks
+// allocated before it are also processed.
+void circdone(void *addr)
+{
+    struct hdr *meta;
+    meta = (struct hdr *)(addr - sizeof(struct hdr));
+    meta->free = HDR_DONE;
+}
+
+// Give the processed blocks at the tail to `sink` in the order they were
+// allocated, freeing each one after. This is the same walk as `circfree`, so
+// consumers finishing out of order don't need their own reorder buffer. Blocks
+// freed directly with `circfree()` are skipped. Returns the number of blocks
+// emitted.
+int circemit(void (*sink)(void *addr))
+{
+    struct hdr *meta;
+    int count = 0;
+
+    while (circ_head != circ_tail) {
+        meta = (struct hdr *)(buffer + circ_tail);
+        if (meta->free == HDR_GAP) {
+            meta = (struct hdr *)(buffer + (circ_tail + meta->len) % BUFFSIZE);
+        }
+        if (meta->free != HDR_DONE) break;
+
+        // Freeing moves the tail past this block, and any freed blocks after it.
+        sink((uint8_t *)meta + sizeof(struct hdr));
+        circfree((uint8_t *)meta + sizeof(struct hdr));
+        count++;
+    }
+    return count;
+}
+
+// The producer is done writing the block, and it may be synced.
+void circcommit(void *addr)
+{
+    struct hdr *meta;
+    meta = (struct hdr *)(addr - sizeof(struct hdr));
+    meta->free = HDR_COMMIT;
+}
+
+// Make all blocks committed since the last sync durable with as few calls to
+// `flush` as possible, which is given the range of the buffer to write out,
+// e.g. with `msync()` or `pwrite()` and `fdatasync()`. The range is only split
+// if it wraps around the end of the buffer. Syncing stops at the first block
+// that isn't committed yet, so the durable blocks are always a prefix of what
+// was allocated. Returns the number of blocks synced.
+int circsync(void (*flush)(uint32_t offset, uint32_t len))
+{
+    struct hdr *meta;
+    uint32_t offset;
+    uint32_t start;
+    int count = 0;
+
+    start = circ_synced;
+    offset = circ_synced;
+    while (offset != circ_head) {
+        meta = (struct hdr *)(buffer + offset);
+        if (meta->free == HDR_GAP) {
+            meta = (struct hdr *)(buffer + (offset + meta->len) % BUFFSIZE);
+        }
+        if (meta->free == HDR_COMMIT) {
+            count++;
+        } else if (meta->free != HDR_FREE) {
+            break;
+        }
+        offset = ((uint8_t *)meta - buffer + meta->len) % BUFFSIZE;
+    }
+    if (offset == start) return 0;
+
+    if (offset > start) {
+        flush(start, offset - start);
+    } else {
+        flush(start, BUFFSIZE - start);
+        if (offset) flush(0, offset);
+    }
+
+    // Only now the blocks may be consumed and freed.
+    while (start != offset) {
+        meta = (struct hdr *)(buffer + start);
+        if (meta->free == HDR_COMMIT) meta->free = HDR_INUSE;
+        start = (start + meta->len) % BUFFSIZE;
+    }
+    circ_synced = offset;
+    return count;
+}
+
+// Check if a block returned by `circalloc()` has been synced. All producers
+// waiting for their blocks are released by the same `circsync()`.
+int circdurable(void *addr)
+{
+    uint32_t offset = (uint8_t *)addr - sizeof(struct hdr) - buffer;
+    return (offset + BUFFSIZE - circ_tail) % BUFFSIZE <
+        (circ_synced + BUFFSIZE - circ_tail) % BUFFSIZE;
+}
+
+// Find the cursor called `name`, or create it at the tail if it doesn't exist
+// yet. Names longer than CURSOR_NAMELEN - 1 are truncated. Returns -1 if all
+// cursors are used.
+int circcursor(const char *name)
+{
+    int empty = -1;
+
+    for (int c = 0; c < CURSOR_MAX; c++) {
+        int i = 0;
+        if (circ_cursors[c].name[0] == 0) {
+            if (empty < 0) empty = c;
+            continue;
+        }
+        while (i < CURSOR_NAMELEN - 1 && name[i] && circ_cursors[c].name[i] == name[i]) i++;
+        if (circ_cursors[c].name[i] == (i < CURSOR_NAMELEN - 1 ? name[i] : 0)) return c;
+    }
+    if (empty < 0) return -1;
+
+    int i = 0;
+    for (; i < CURSOR_NAMELEN - 1 && name[i]; i++) {
+        circ_cursors[empty].name[i] = name[i];
+    }
+    circ_cursors[empty].name[i] = 0;
+    circ_cursors[empty].pos = circ_tail;
+    return empty;
+}
+
+// Get the position to resume cursor `c` from. If the blocks were freed by
+// others in the meantime, resume from the tail.
+uint32_t circcursorpos(int c)
+{
+    uint32_t pos = circ_cursors[c].pos;
+    if ((pos + BUFFSIZE - circ_tail) % BUFFSIZE > (circ_head + BUFFSIZE - circ_tail) % BUFFSIZE) {
+        return circ_tail;
+    }
+    return pos;
+}
+
+// Store the position of cursor `c`. To keep writes to the persisted buffer
+// down, it's only stored once it moved at least CURSOR_BATCH bytes, so a
+// restarted consumer might see a few blocks again. Use `force` when stopping to
+// resume exactly where the consumer left off.
+void circcursorsave(int c, uint32_t pos, int force)
+{
+    if (force || (pos + BUFFSIZE - circ_cursors[c].pos) % BUFFSIZE >= CURSOR_BATCH) {
+        circ_cursors[c].pos = pos;
+    }
+}
+
+// Get the next block for consumer `self` to process. The consumer works on its
+// own batch oldest first, refills it from the ring when empty, and once the
+// ring is drained steals the newest block of the busiest other consumer. The
+// caller frees the block with `circfree()` when done, in any order, and the
+// tail is reclaimed once all older blocks are freed.
+void *circwork(struct worker *workers, int nworkers, int self)
+{
+    struct worker *w = &workers[self];
+    struct worker *victim = NULL;
+    void *p;
+
+    if (w->first == w->last) {
+        w->first = 0;
+        w->last = 0;
+        while (w->last < WORKER_BATCH && (p = circnext(&circ_claim, circ_head)) != NULL) {
+            w->blocks[w->last++] = p;
+        }
+    }
+    if (w->first != w->last) return w->blocks[w->first++];
+
+    // Like `circalloc` and `circfree`, this isn't yet lockless. When consumers
+    // run on their own threads, `circ_claim`, `first` and `last` must be
+    // updated atomically.
+    for (int i = 0; i < nworkers; i++) {
+        int n = workers[i].last - workers[i].first;
+        if (n > 0 && (victim == NULL || n > victim->last - victim->first)) {
+            victim = &workers[i];
+        }
+    }
+    if (victim == NULL) return NULL;
+    return victim->blocks[--victim->last];
+}
+
+// Find the index entry of the newest block with a sequence number not after
+// `key`, or if `bytime`, with a time before `key`, as the blocks before an entry
+// might have the same time. Returns -1 if there is no such entry.
+static int circindexfind(uint64_t key, int bytime)
+{
+    int lo = 0;
+    int hi;
+    int found = -1;
+
+    circindexprune();
+    hi = (int)circ_idxcount - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        struct idxentry *entry = &circ_blockindex[(circ_idxfirst + mid) % INDEX_MAX];
+        int after = bytime ?
+            entry->time >= key :
+            (int32_t)(entry->seq - (uint32_t)key) > 0;
+        if (after) {
+            hi = mid - 1;
+        } else {
+            found = mid;
+            lo = mid + 1;
+        }
+    }
+    return found < 0 ? -1 : (int)((circ_idxfirst + found) % INDEX_MAX);
+}
+
+// Find the block with the sequence number `n`, walking at most INDEX_EVERY - 1
+// blocks from the nearest index entry, and any blocks allocated from
+// reservations in between. Returns NULL if the block isn't in the index range
+// any more, isn't allocated yet, or is after a reservation still in use or a
+// block not synced yet.
+void *circseek(uint32_t n)
+{
+    int i = circindexfind(n, 0);
+    uint32_t cursor;
+    uint32_t s;
+    void *p;
+
+    if (i < 0) return NULL;
+    cursor = circ_blockindex[i].offset;
+    s = circ_blockindex[i].seq;
+    while ((p = circnextblock(&cursor, circ_head)) != NULL) {
+        if (((struct hdr *)(p - sizeof(struct hdr)))->flags & HDR_TOKEN) continue;
+        if (s == n) return p;
+        s++;
+    }
+    return NULL;
+}
+
+// Find the indexed block to start reading from to see all blocks allocated at
+// `time` or later. Returns NULL if `time` isn't after the oldest entry.
+void *circseektime(uint64_t time)
+{
+    int i = circindexfind(time, 1);
+    if (i < 0) return NULL;
+    return buffer + circ_blockindex[i].offset + sizeof(struct hdr);
+}
+
+void circlayout(struct layout *layout)
+{
+    layout->version = LAYOUT_VERSION;
+    layout->hdrsize = sizeof(struct hdr);
+    layout->align = 16;        // See `circalloc()`
+    layout->size = BUFFSIZE;
+}
+
+// Check if the blocks described by `layout` can be used by this program.
+int circlayoutcheck(const struct layout *layout)
+{
+    struct layout ours;
+
+    circlayout(&ours);
+    if (layout->version != ours.version || layout->hdrsize != ours.hdrsize ||
+        layout->align != ours.align) {
+        return LAYOUT_INCOMPATIBLE;
+    }
+    if (layout->size == 0 || layout->size % layout->align != 0) return LAYOUT_INCOMPATIBLE;
+    if (layout->size != ours.size) return LAYOUT_REPACK;
+    return LAYOUT_SAME;
+}
+
+// Write the used part of the buffer, with the index and cursors, to `out`, e.g.
+// a file. This is also the checkpoint that `circrestore()` restarts from.
+void circdump(void (*out)(const void *data, uint32_t len))
+{
+    struct dumphdr dump;
+
+    circindexprune();
+    dump.magic = DUMP_MAGIC;
+    circlayout(&dump.layout);
+    dump.head = circ_head;
+    dump.tail = circ_tail;
+    dump.seq = circ_seq;
+    dump.idxcount = circ_idxcount;
+    dump.claim = circ_claim;
+    dump.synced = circ_synced;
+    dump.ncursors = CURSOR_MAX;
+    out(&dump, sizeof(dump));
+    out(circ_cursors, sizeof(circ_cursors));
+
+    for (uint32_t i = 0; i < circ_idxcount; i++) {
+        out(&circ_blockindex[(circ_idxfirst + i) % INDEX_MAX], sizeof(struct idxentry));
+    }
+
+    if (circ_head >= circ_tail) {
+        out(buffer + circ_tail, circ_head - circ_tail);
+    } else {
+        out(buffer + circ_tail, BUFFSIZE - circ_tail);
+        out(buffer, circ_head);
+    }
+}
+
+// Call `decode` for every allocated block in `len` bytes of a dump, starting at
+// a block. Returns the number of blocks decoded.
+int circdumpwalk(const uint8_t *data, uint32_t len,
+                 void (*decode)(void *ctx, const void *payload, uint32_t len),
+                 void *ctx)
+{
+    const struct hdr *meta;
+    uint32_t pos = 0;
+    int count = 0;
+
+    // A gap in a dump is followed directly by the next block, as the dump
+    // doesn't wrap.
+    while (pos + sizeof(struct hdr) <= len) {
+        meta = (const struct hdr *)(data + pos);
+        if (meta->len < sizeof(struct hdr) || meta->len > len - pos) break;
+        if (meta->free != HDR_GAP && meta->free != HDR_FREE &&
+            meta->free != HDR_RESERVED) {
+            decode(ctx, data + pos + sizeof(struct hdr), meta->len - sizeof(struct hdr));
+            count++;
+        }
+        pos += meta->len;
+    }
+    return count;
+}
+
+// Copy the blocks of a dump from a buffer of another size one by one into this
+// buffer. Cursors move with the block they point at, and the index and
+// sequence numbers start over. Returns -1 if the blocks don't fit, leaving the
+// buffer empty.
+static int circrepack(const struct dumphdr *dhdr, const struct cursor *dcursors,
+               const uint8_t *blocks, uint32_t used)
+{
+    uint32_t oldsize = dhdr->layout.size;
+    uint32_t *moved[CURSOR_MAX + 2];
+    uint32_t from[CURSOR_MAX + 2];
+    const struct hdr *meta;
+    struct hdr *nmeta;
+    uint32_t pos = 0;
+    void *p;
+
+    circ_head = 0;
+    circ_tail = 0;
+    circ_seq = 0;
+    circ_idxfirst = 0;
+    circ_idxcount = 0;
+    circ_freehint = UINT32_MAX;
+    for (int c = 0; c < CURSOR_MAX; c++) {
+        circ_cursors[c] = dcursors[c];
+        moved[c] = &circ_cursors[c].pos;
+        from[c] = (dcursors[c].pos + oldsize - dhdr->tail) % oldsize;
+    }
+    moved[CURSOR_MAX] = &circ_claim;
+    from[CURSOR_MAX] = (dhdr->claim + oldsize - dhdr->tail) % oldsize;
+    moved[CURSOR_MAX + 1] = &circ_synced;
+    from[CURSOR_MAX + 1] = (dhdr->synced + oldsize - dhdr->tail) % oldsize;
+
+    while (pos < used) {
+        meta = (const struct hdr *)(blocks + pos);
+        if (meta->len < sizeof(struct hdr) || meta->len > used - pos) break;
+
+        // A cursor pointing at a block that isn't copied moves to the next one.
+        for (int c = 0; c < CURSOR_MAX + 2; c++) {
+            if (from[c] <= pos) {
+                *moved[c] = circ_head;
+                from[c] = UINT32_MAX;
+            }
+        }
+
+        if (meta->free != HDR_GAP && meta->free != HDR_FREE &&
+            meta->free != HDR_RESERVED) {
+            p = circalloc(meta->len - sizeof(struct hdr));
+            if (p == NULL) {
+                circ_head = 0;
+                circ_tail = 0;
+                return -1;
+            }
+            for (uint32_t i = sizeof(struct hdr); i < meta->len; i++) {
+                ((uint8_t *)p)[i - sizeof(struct hdr)] = blocks[pos + i];
+            }
+            nmeta = (struct hdr *)(p - sizeof(struct hdr));
+            nmeta->free = meta->free;
+            nmeta->schema = meta->schema;
+        }
+        pos += meta->len;
+    }
+
+    for (int c = 0; c < CURSOR_MAX + 2; c++) {
+        if (from[c] != UINT32_MAX) *moved[c] = circ_head;
+    }
+    return 0;
+}
+
+// Check that the positions and blocks of a dump are within its buffer, that
+// the blocks are linked from the tail to the head, and that the index entries
+// are at blocks, oldest first, before anything is copied. The run lengths of
+// free blocks aren't checked, as `circrestore()` sets them again. Returns -1 if
+// they aren't.
+static int circdumpcheck(const struct dumphdr *dhdr, const struct cursor *dcursors,
+                         const struct idxentry *entry, const uint8_t *blocks,
+                         uint32_t used)
+{
+    uint32_t size = dhdr->layout.size;
+    const struct hdr *meta;
+    uint32_t pos = 0;
+    uint32_t i = 0;
+
+    if (dhdr->claim >= size || dhdr->synced >= size) return -1;
+    for (int c = 0; c < CURSOR_MAX; c++) {
+        if (dcursors[c].pos >= size) return -1;
+    }
+    for (uint32_t i = 0; i < dhdr->idxcount; i++) {
+        if (entry[i].offset >= size) return -1;
+    }
+
+    // Only a gap may end at the end of the buffer, every other block is before
+    // it.
+    while (pos < used) {
+        meta = (const struct hdr *)(blocks + pos);
+        if (used - pos < sizeof(struct hdr)) return -1;
+        if (meta->len < sizeof(struct hdr) || meta->len % dhdr->layout.align != 0) return -1;
+        if (meta->len > used - pos || meta->free > HDR_RESERVED) return -1;
+        if ((dhdr->tail + pos) % size + meta->len > size) return -1;
+        while (i < dhdr->idxcount && (entry[i].offset + size - dhdr->tail) % size == pos) i++;
+        pos += meta->len;
+    }
+    return i == dhdr->idxcount ? 0 : -1;
+}
+
+// Restart from a checkpoint written by `circdump()`, which the caller has read
+// or mapped to memory. If the layout is the same, the blocks are copied back
+// to the offsets they had, so that blocks, cursors and index are exactly as
+// before, and all the memory that is used again is touched. Reservations are
+// given back, as no one holds them anymore. If only the size of the buffer
+// changed, the blocks are repacked with `circrepack()`. Returns -1 if the dump
+// can't be used, leaving everything unchanged.
+int circrestore(const uint8_t *dump, uint32_t len)
+{
+    const struct dumphdr *dhdr = (const struct dumphdr *)dump;
+    const struct cursor *dcursors;
+    const struct idxentry *entry;
+    const uint8_t *blocks;
+    uint32_t used;
+    int check;
+
+    if (len < sizeof(struct dumphdr) || dhdr->magic != DUMP_MAGIC) return -1;
+    check = circlayoutcheck(&dhdr->layout);
+    if (check == LAYOUT_INCOMPATIBLE || dhdr->ncursors != CURSOR_MAX) return -1;
+    if (dhdr->idxcount > INDEX_MAX) return -1;
+    if (dhdr->head >= dhdr->layout.size || dhdr->tail >= dhdr->layout.size) return -1;
+    used = (dhdr->head + dhdr->layout.size - dhdr->tail) % dhdr->layout.size;
+    dcursors = (const struct cursor *)(dump + sizeof(struct dumphdr));
+    entry = (const struct idxentry *)(dcursors + CURSOR_MAX);
+    blocks = (const uint8_t *)(entry + dhdr->idxcount);
+    if (blocks + used > dump + len) return -1;
+    if (circdumpcheck(dhdr, dcursors, entry, blocks, used) < 0) return -1;
+    if (check == LAYOUT_REPACK) return circrepack(dhdr, dcursors, blocks, used);
+
+    for (uint32_t i = 0; i < used; i++) {
+        buffer[(dhdr->tail + i) % BUFFSIZE] = blocks[i];
+    }
+    for (int c = 0; c < CURSOR_MAX; c++) {
+        circ_cursors[c] = dcursors[c];
+    }
+    for (uint32_t i = 0; i < dhdr->idxcount; i++) {
+        circ_blockindex[i] = entry[i];
+    }
+    circ_idxfirst = 0;
+    circ_idxcount = dhdr->idxcount;
+    circ_freehint = UINT32_MAX;
+    circ_seq = dhdr->seq;
+    circ_claim = dhdr->claim;
+    circ_synced = dhdr->synced;
+    circ_tail = dhdr->tail;
+    circ_head = dhdr->head;
+
+    // The runs of free blocks in the dump aren't trusted, every free block
+    // starts over with a run of its own.
+    for (uint32_t offset = circ_tail; offset != circ_head; ) {
+        struct hdr *meta = (struct hdr *)(buffer + offset);
+        if (meta->free == HDR_RESERVED) meta->free = HDR_FREE;
+        if (meta->free == HDR_FREE) *circrun(meta) = meta->len;
+        offset = (offset + meta->len) % BUFFSIZE;
+    }
+    circwalktail();
+    return 0;
+}
+// Shrink the newest block to `size` bytes, giving the rest back to the head.
+// Returns -1 if another block was allocated since, or if it would grow.
+int circtrim(void *addr, uint32_t size)
+{
+    struct hdr *meta;
+    uint32_t offset;
+    uint32_t block_size = CIRC_BLOCKSIZE(size);
+
+    meta = (struct hdr *)(addr - sizeof(struct hdr));
+    offset = (uint8_t *)meta - buffer;
+    if ((offset + meta->len) % BUFFSIZE != circ_head) return -1;
+    if (block_size > meta->len) return -1;
+    meta->len = block_size;
+    circ_head = (offset + block_size) % BUFFSIZE;
+    return 0;
+}
+
+// Take back the newest block from `circalloc()`, as if it was never allocated,
+// e.g. when nothing was written to it. Like `circtrim()`, the space goes back
+// to the head, and the block's sequence number and index entry are given back
+// too. A block at the start of the buffer might follow a gap, which must be
+// followed by a block, so it's freed like the rest of a reservation instead,
+// which consumers skip. Returns -1 if another block was allocated since.
+int circunalloc(void *addr)
+{
+    struct hdr *meta;
+    uint32_t offset;
+
+    meta = (struct hdr *)(addr - sizeof(struct hdr));
+    offset = (uint8_t *)meta - buffer;
+    if ((offset + meta->len) % BUFFSIZE != circ_head) return -1;
+
+    circ_seq--;
+    if (circ_idxcount > 0 &&
+        circ_blockindex[(circ_idxfirst + circ_idxcount - 1) % INDEX_MAX].offset == offset) {
+        circ_idxcount--;
+    }
+    circ_stats.allocs--;
+    if (offset != 0) {
+        circ_head = offset;
+        return 0;
+    }
+    meta->free = HDR_FREE;
+    meta->flags = HDR_TOKEN;
+    *circrun(meta) = meta->len;
+    circwalktail();
+    return 0;
+}
+
+// Tag the block at `addr` with the id of the schema of its payload, so that
+// consumers can tell what it is, e.g. with the views made by `schemagen`. Zero
+// means untagged, which every block is when allocated.
+void circtag(void *addr, uint8_t schema)
+{
+    ((struct hdr *)(addr - sizeof(struct hdr)))->schema = schema;
+}
+
+uint8_t circschema(const void *addr)
+{
+    return ((const struct hdr *)(addr - sizeof(struct hdr)))->schema;
+}
+
+// Reserve `len` bytes for blocks allocated later with `circresalloc()`, e.g.
+// all messages of a transaction, so that it can't fail halfway. Each block
+// takes CIRC_BLOCKSIZE(size) of the reservation. Blocks allocated after the
+// reservation are only seen by consumers once it's released. Returns -1 if
+// there isn't enough contiguous space.
+int circreserve(struct reservation *r, uint32_t len)
+{
+    uint32_t offset = circ_head;
+    uint32_t rem = 0;
+    struct hdr *meta;
+
+    // Checked before rounding up, which would wrap for the largest lengths.
+    if (circ_draining || len >= BUFFSIZE) {
+        circ_stats.failures++;
+        return -1;
+    }
+    len = (len + 0xF) & ~0xF;
+    if (len == 0) len = 0x10;
+    if (circ_head >= circ_tail && BUFFSIZE - circ_head < len) {
+        rem = BUFFSIZE - circ_head;
+        offset = 0;
+    }
+    if (circavail() <= len + rem) {
+        circ_stats.failures++;
+        return -1;
+    }
+
+    circindexprune();
+    circallocblock(rem, HDR_GAP);
+    circallocblock(len, HDR_RESERVED);
+    meta = (struct hdr *)(buffer + offset);
+    meta->flags = HDR_TOKEN;
+    r->offset = offset;
+    r->left = len;
+
+    circ_stats.gapbytes += rem;
+    if (BUFFSIZE - circavail() > circ_stats.peak) circ_stats.peak = BUFFSIZE - circavail();
+    return 0;
+}
+
+// Allocate `size` bytes from the reservation `r`. Blocks are in the order
+// they're allocated in, and don't get a sequence number or index entry. Only
+// returns NULL if the reservation is too small, which is a bug of the caller.
+void *circresalloc(struct reservation *r, uint32_t size)
+{
+    uint32_t block_size = CIRC_BLOCKSIZE(size);
+    uint32_t offset = r->offset;
+    struct hdr *meta;
+
+    CIRC_ASSERT(size < r->left && block_size <= r->left);
+    if (size >= r->left || block_size > r->left) return NULL;
+
+    if (block_size < r->left) {
+        meta = (struct hdr *)(buffer + offset + block_size);
+        meta->free = HDR_RESERVED;
+        meta->flags = HDR_TOKEN;
+        meta->site = 0;
+        meta->schema = 0;
+        meta->len = r->left - block_size;
+    }
+    meta = (struct hdr *)(buffer + offset);
+    meta->free = HDR_INUSE;
+    meta->flags = HDR_TOKEN;
+    meta->site = 0;
+    meta->schema = 0;
+    meta->len = block_size;
+    r->offset = (offset + block_size) % BUFFSIZE;
+    r->left -= block_size;
+
+    circ_stats.allocs++;
+    return buffer + offset + sizeof(struct hdr);
+}
+
+// Give back what's left of the reservation `r`. If nothing was allocated after
+// it, the space goes back to the head, else it's freed like a block.
+void circresrelease(struct reservation *r)
+{
+    struct hdr *meta;
+
+    if (r->left == 0) return;
+    meta = (struct hdr *)(buffer + r->offset);
+    // A reservation at the start may have left a gap at the end of the
+    // buffer, which must be followed by a block.
+    if (r->offset != 0 && (r->offset + r->left) % BUFFSIZE == circ_head) {
+        circ_head = r->offset;
+    } else {
+        meta->free = HDR_FREE;
+        *circrun(meta) = meta->len;
+        circwalktail();
+    }
+    r->left = 0;
+}
+
+// Publish the block the coalescer `c` is filling. Returns the block, or NULL if
+// there are no records.
+void *circcoalflush(struct coalescer *c)
+{
+    uint32_t *p;
+
+    if (c->used == 0) return NULL;
+    p = circresalloc(&c->resv, sizeof(uint32_t) + c->used);
+    p[0] = c->used;
+    circresrelease(&c->resv);
+    c->used = 0;
+    return p;
+}
+
+// Publish the block the coalescer `c` is filling if it's open for `delay`
+// already. Producers call this when idle, so records aren't held back longer.
+void *circcoalpoll(struct coalescer *c)
+{
+    if (c->used == 0 || !circclock || circclock() < c->deadline) return NULL;
+    return circcoalflush(c);
+}
+
+// Add the record `data` of `len` bytes to the coalescer `c`. Returns -1 if
+// there's no space for a new block.
+int circcoalesce(struct coalescer *c, const void *data, uint32_t len)
+{
+    uint32_t need = sizeof(uint32_t) + ((len + 3) & ~3);
+    uint32_t size = CIRC_BLOCKSIZE(sizeof(uint32_t) + need);
+    uint8_t *p;
+
+    if (c->used && CIRC_BLOCKSIZE(sizeof(uint32_t) + c->used + need) > c->resv.left) {
+        circcoalflush(c);
+    }
+    if (c->used == 0) {
+        if (circreserve(&c->resv, size > COALESCE_SIZE ? size : COALESCE_SIZE) < 0) {
+            return -1;
+        }
+        c->deadline = (circclock ? circclock() : 0) + c->delay;
+    }
+
+    // After the block header and the total length.
+    p = buffer + c->resv.offset + sizeof(struct hdr) + sizeof(uint32_t) + c->used;
+    *(uint32_t *)p = len;
+    for (uint32_t i = 0; i < len; i++) {
+        p[sizeof(uint32_t) + i] = ((const uint8_t *)data)[i];
+    }
+    c->used += need;
+    circcoalpoll(c);
+    return 0;
+}
+
+// Get the record at `pos` in a block published by a coalescer, moving `pos` to
+// the next one. Start with a `pos` of zero. Returns NULL after the last record.
+void *circrecord(void *block, uint32_t *pos, uint32_t *len)
+{
+    uint8_t *p = (uint8_t *)block + sizeof(uint32_t) + *pos;
+
+    if (*pos >= *(uint32_t *)block) return NULL;
+    *len = *(uint32_t *)p;
+    *pos += sizeof(uint32_t) + ((*len + 3) & ~3);
+    return p + sizeof(uint32_t);
+}
+
+// Register a reader thread. Returns its id, or -1 if there are too many. Like
+// `circquiescent()`, the reader is registered with atomic stores, as writers
+// look at it concurrently. Readers must not register at the same time.
+int circreader(void)
+{
+    for (int r = 0; r < READER_MAX; r++) {
+        if (!__atomic_load_n(&circ_reading[r], __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&circ_readers[r], __atomic_load_n(&circ_epoch, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELEASE);
+            __atomic_store_n(&circ_reading[r], 1, __ATOMIC_SEQ_CST);
+            return r;
+        }
+    }
+    return -1;
+}
+
+// The reader doesn't read blocks anymore, and doesn't hold up frees.
+void circreaderdone(int r)
+{
+    __atomic_store_n(&circ_reading[r], 0, __ATOMIC_RELEASE);
+}
+
+// Called by a reader when it holds no pointers to blocks, e.g. between
+// requests. It's a single store, without a read-modify-write. The store
+// releases, so the reader's loads from blocks can't be reordered after it,
+// and the blocks aren't freed while they're still read. The epoch is loaded
+// with acquire, pairing with the increment in `circfree_deferred()`, so once
+// the reader announced an epoch, it can't load a pointer unpublished before.
+void circquiescent(int r)
+{
+    __atomic_store_n(&circ_readers[r], __atomic_load_n(&circ_epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+
+// Free all deferred blocks that no reader can see anymore. Returns the number
+// of blocks freed.
+int circreclaim(void)
+{
+    uint32_t oldest = circ_epoch;
+    int count = 0;
+
+    for (int r = 0; r < READER_MAX; r++) {
+        uint32_t seen = __atomic_load_n(&circ_readers[r], __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&circ_reading[r], __ATOMIC_ACQUIRE) &&
+            (int32_t)(seen - oldest) < 0) {
+            oldest = seen;
+        }
+    }
+    while (circ_defercount > 0 && (int32_t)(circ_deferepoch[circ_deferfirst] - oldest) <= 0) {
+        circfree(circ_deferred[circ_deferfirst]);
+        circ_deferfirst = (circ_deferfirst + 1) % DEFER_MAX;
+        circ_defercount--;
+        count++;
+    }
+    return count;
+}
+
+// Free a block once all readers have been quiescent, instead of now. Returns
+// -1 if too many frees are waiting for a slow reader, in which case the block
+// isn't freed and the caller should try again later.
+int circfree_deferred(void *addr)
+{
+    if (circ_defercount == DEFER_MAX) {
+        circreclaim();
+        if (circ_defercount == DEFER_MAX) return -1;
+    }
+
+    // Readers load the epoch concurrently, and must see the block unpublished
+    // by the caller before it.
+    circ_deferred[(circ_deferfirst + circ_defercount) % DEFER_MAX] = addr;
+    circ_deferepoch[(circ_deferfirst + circ_defercount) % DEFER_MAX] =
+        __atomic_add_fetch(&circ_epoch, 1, __ATOMIC_SEQ_CST);
+    circ_defercount++;
+    circreclaim();
+    return 0;
+}
+
+// Freeze all blocks allocated until now for a bulk consumer, which reads them
+// with `circnext()` from the tail up to the returned end. Producers keep
+// allocating after the end in the meantime. The snapshot ends before the first
+// reservation still in use or block not synced yet, where `circnext()` stops,
+// so that releasing it doesn't drop them.
+uint32_t circsnapshot(void)
+{
+    struct hdr *meta;
+    uint32_t offset;
+
+    for (offset = circ_tail; offset != circ_head; offset = (offset + meta->len) % BUFFSIZE) {
+        meta = (struct hdr *)(buffer + offset);
+        if (meta->free == HDR_RESERVED || meta->free == HDR_COMMIT) break;
+    }
+    return offset;
+}
+
+// The bulk consumer is done with a snapshot, so all of it is reclaimed at once
+// without freeing every block. The blocks in it must not be used or freed
+// anymore, and the cursors that were in it move to the end.
+void circsnaprelease(uint32_t end)
+{
+    uint32_t from = circ_tail;
+
+    circ_tail = end;
+    circpassed(&circ_claim, from);
+    circpassed(&circ_synced, from);
+    circ_freehint = UINT32_MAX;
+}
+
+// Encode `v` as a protobuf varint. Returns the number of bytes used, at most 10.
+static uint32_t pbvarint(uint8_t *p, uint64_t v)
+{
+    uint32_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// Write the protobuf field `field` of wire type 2 (length delimited).
+static void pbbytes(void (*out)(const void *data, uint32_t len), uint32_t field,
+             const void *data, uint32_t len)
+{
+    uint8_t tag[20];
+    uint32_t n = pbvarint(tag, field << 3 | 2);
+    n += pbvarint(tag + n, len);
+    out(tag, n);
+    out(data, len);
+}
+
+// Write the live blocks from the tail to the head that were sampled as a heap
+// profile in the pprof format to `out`, e.g. a file, so that it can be viewed
+// with `pprof <program> <file>`. Every block is counted `circ_profilerate`
+// times, as only every n-th block was sampled. Only the address that called
+// `circalloc()` is known, so each stack has one frame. No mappings are written,
+// so pprof can only symbolize the addresses of a program built with `-no-pie`.
+void circprofile(void (*out)(const void *data, uint32_t len))
+{
+    static const char *strings[] = {
+        "", "inuse_objects", "count", "inuse_space", "bytes"
+    };
+    uint64_t objects[SITE_MAX] = { 0 };
+    uint64_t bytes[SITE_MAX] = { 0 };
+    uint8_t msg[64];
+    uint8_t values[32];
+    uint32_t cursor = circ_tail;
+    uint32_t n;
+    uint32_t v;
+    struct hdr *meta;
+    void *p;
+
+    while (cursor != circ_head) {
+        // Look past reservations still in use, and count blocks not synced
+        // yet, which consumers wait for.
+        if ((p = circnext(&cursor, circ_head)) == NULL) {
+            meta = (struct hdr *)(buffer + cursor);
+            if (cursor == circ_head) break;
+            if (meta->free != HDR_RESERVED && meta->free != HDR_COMMIT) break;
+            cursor = (cursor + meta->len) % BUFFSIZE;
+            if (meta->free == HDR_RESERVED) continue;
+            p = (uint8_t *)meta + sizeof(struct hdr);
+        }
+        meta = (struct hdr *)(p - sizeof(struct hdr));
+        if (meta->free == HDR_FREE || meta->site == 0) continue;
+        objects[meta->site - 1] += circ_profilerate;
+        bytes[meta->site - 1] += (uint64_t)meta->len * circ_profilerate;
+    }
+
+    // sample_type: inuse_objects/count, inuse_space/bytes.
+    for (int i = 0; i < 2; i++) {
+        n = pbvarint(msg, 1 << 3);
+        n += pbvarint(msg + n, 2 * i + 1);
+        n += pbvarint(msg + n, 2 << 3);
+        n += pbvarint(msg + n, 2 * i + 2);
+        pbbytes(out, 1, msg, n);
+    }
+
+    // sample: location_id and the values, both packed.
+    for (uint16_t i = 0; i < circ_nsites; i++) {
+        if (objects[i] == 0) continue;
+        n = pbvarint(msg, 1 << 3 | 2);
+        n += pbvarint(msg + n, pbvarint(values, i + 1));
+        n += pbvarint(msg + n, i + 1);
+        v = pbvarint(values, objects[i]);
+        v += pbvarint(values + v, bytes[i]);
+        n += pbvarint(msg + n, 2 << 3 | 2);
+        n += pbvarint(msg + n, v);
+        for (uint32_t j = 0; j < v; j++) {
+            msg[n++] = values[j];
+        }
+        pbbytes(out, 2, msg, n);
+    }
+
+    // location: the id and address of every site.
+    for (uint16_t i = 0; i < circ_nsites; i++) {
+        n = pbvarint(msg, 1 << 3);
+        n += pbvarint(msg + n, i + 1);
+        n += pbvarint(msg + n, 3 << 3);
+        n += pbvarint(msg + n, circ_sites[i]);
+        pbbytes(out, 4, msg, n);
+    }
+
+    for (uint32_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        n = 0;
+        while (strings[i][n]) n++;
+        pbbytes(out, 6, strings[i], n);
+    }
+}
+
+// Append `str` to `buf` at `pos`, if it fits.
+static void metricstr(char *buf, uint32_t len, uint32_t *pos, const char *str)
+{
+    while (*str) {
+        if (*pos < len) buf[*pos] = *str;
+        (*pos)++;
+        str++;
+    }
+}
+
+static void metricnum(char *buf, uint32_t len, uint32_t *pos, uint64_t v)
+{
+    char digits[21];
+    int n = sizeof(digits) - 1;
+
+    digits[n] = 0;
+    do {
+        digits[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    metricstr(buf, len, pos, digits + n);
+}
+
+// Write a sample `name{pool="<pool>"<labels>} v` on its own line.
+static void metric(char *buf, uint32_t len, uint32_t *pos, const char *name,
+            const char *pool, const char *labels, uint64_t v)
+{
+    metricstr(buf, len, pos, name);
+    metricstr(buf, len, pos, "{pool=\"");
+    metricstr(buf, len, pos, pool);
+    metricstr(buf, len, pos, "\"");
+    metricstr(buf, len, pos, labels);
+    metricstr(buf, len, pos, "} ");
+    metricnum(buf, len, pos, v);
+    metricstr(buf, len, pos, "\n");
+}
+
+// Write the counters in the OpenMetrics text format to `buf`, with the label
+// `pool` to tell buffers apart. Nothing is allocated, so this can be called
+// while measuring. Returns the length written, or -1 if `len` is too small.
+int circmetrics(char *buf, uint32_t len, const char *pool)
+{
+    static const char *le[WALK_BUCKETS] = {
+        ",le=\"0\"", ",le=\"1\"", ",le=\"2\"", ",le=\"4\"", ",le=\"8\"", ",le=\"+Inf\""
+    };
+    uint32_t pos = 0;
+    uint64_t count = 0;
+
+    metricstr(buf, len, &pos, "# TYPE circalloc_used_bytes gauge\n");
+    metric(buf, len, &pos, "circalloc_used_bytes", pool, "", BUFFSIZE - circavail());
+    metricstr(buf, len, &pos, "# TYPE circalloc_peak_bytes gauge\n");
+    metric(buf, len, &pos, "circalloc_peak_bytes", pool, "", circ_stats.peak);
+    metricstr(buf, len, &pos, "# TYPE circalloc_size_bytes gauge\n");
+    metric(buf, len, &pos, "circalloc_size_bytes", pool, "", BUFFSIZE);
+    metricstr(buf, len, &pos, "# TYPE circalloc_allocs counter\n");
+    metric(buf, len, &pos, "circalloc_allocs_total", pool, "", circ_stats.allocs);
+    metricstr(buf, len, &pos, "# TYPE circalloc_alloc_failures counter\n");
+    metric(buf, len, &pos, "circalloc_alloc_failures_total", pool, "", circ_stats.failures);
+    metricstr(buf, len, &pos, "# TYPE circalloc_frees counter\n");
+    metric(buf, len, &pos, "circalloc_frees_total", pool, "", circ_stats.frees);
+    metricstr(buf, len, &pos, "# TYPE circalloc_gap_bytes counter\n");
+    metric(buf, len, &pos, "circalloc_gap_bytes_total", pool, "", circ_stats.gapbytes);
+    metricstr(buf, len, &pos, "# TYPE circalloc_free_walk_blocks histogram\n");
+    for (int i = 0; i < WALK_BUCKETS; i++) {
+        count += circ_stats.walks[i];
+        metric(buf, len, &pos, "circalloc_free_walk_blocks_bucket", pool, le[i], count);
+    }
+    metric(buf, len, &pos, "circalloc_free_walk_blocks_count", pool, "", count);
+    metric(buf, len, &pos, "circalloc_free_walk_blocks_sum", pool, "", circ_stats.walked);
+    metricstr(buf, len, &pos, "# EOF\n");
+
+    if (pos >= len) return -1;
+    buf[pos] = 0;
+    return pos;
+}
@@ -0,0 +1,329 @@
+#ifndef CIRCALLOC_H
+#define CIRCALLOC_H
+
+// The allocator core. It only needs the freestanding headers, so it builds
+// without a C library, e.g. for bare-metal or RTOS targets:
+//
+//   gcc -ffreestanding -nostdlib -c circalloc.c
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Must be a multiple of alignment, e.g. 16. The fast path of `circalloc()` is
+// inlined into the application, so the size can't be changed by it, only here
+// before the library is built.
+#define BUFFSIZE 2048
+
+// The memory for all blocks. It's defined by the application, so that it can be
+// placed where the application wants, e.g. in a linker section of its own.
+extern uint8_t buffer[BUFFSIZE];
+
+// If head == tail, then we are empty.
+extern uint32_t circ_head;
+extern uint32_t circ_tail;
+
+// The block freed last, so that the next block freed after it can be merged
+// with it. UINT32_MAX if there is none, and whenever the tail moves, as the
+// block might be gone.
+extern uint32_t circ_freehint;
+
+// Set while the buffer is drained with `circquiesce()`, so that no new blocks
+// are allocated.
+extern uint8_t circ_draining;
+
+// The next block to be handed to a consumer. Blocks between `circ_tail` and
+// `circ_claim` are owned by consumers (and may already be freed), blocks
+// between `circ_claim` and `circ_head` are still waiting to be consumed. It
+// moves with the tail when blocks are freed before they're claimed.
+extern uint32_t circ_claim;
+
+// Consumers that need to resume after a restart keep their position in a named
+// cursor. These are stored next to `circ_head` and `circ_tail`, so when the
+// buffer is persisted, so are the cursors.
+#define CURSOR_MAX 4
+#define CURSOR_NAMELEN 12
+#define CURSOR_BATCH 256   // How far a cursor moves before it's stored again
+
+struct cursor {
+    char name[CURSOR_NAMELEN];
+    uint32_t pos;
+};
+
+extern struct cursor circ_cursors[CURSOR_MAX];
+
+// Blocks freed with `circfree_deferred()` while readers may still look at them
+// without owning them. They're only freed once every registered reader has
+// passed a quiescent state since, that is, holds no more pointers into blocks.
+#define READER_MAX 4
+#define DEFER_MAX 16
+
+extern uint32_t circ_epoch;                 // Counts deferred frees
+extern uint32_t circ_readers[READER_MAX];   // The epoch each reader was last quiescent in
+extern uint8_t circ_reading[READER_MAX];    // If the reader is registered
+extern void *circ_deferred[DEFER_MAX];
+extern uint32_t circ_deferepoch[DEFER_MAX];
+extern uint32_t circ_deferfirst;
+extern uint32_t circ_defercount;
+
+// When the buffer is used as a write-ahead log, blocks between `circ_tail` and
+// `circ_synced` are durable. It moves with the tail when blocks are freed
+// before they're synced.
+extern uint32_t circ_synced;
+
+// Sequence number given to the next block allocated.
+extern uint32_t circ_seq;
+
+// A sparse index of the blocks in the buffer, so that a block can be found by
+// sequence number or time without walking from the tail. It's a queue like the
+// buffer, and the oldest entries are dropped once the tail moves past them.
+#define INDEX_EVERY 4      // Index every n-th block allocated
+#define INDEX_MAX 32       // Maximum entries, the oldest are dropped when full
+
+struct idxentry {
+    uint32_t seq;
+    uint32_t offset;
+    uint64_t time;
+};
+
+extern struct idxentry circ_blockindex[INDEX_MAX];
+extern uint32_t circ_idxfirst;
+extern uint32_t circ_idxcount;
+
+// Optional clock to timestamp the index with, in any unit the user likes. If
+// not set, all timestamps are zero.
+extern uint64_t (*circclock)(void);
+
+// Counters of how the buffer is used, see `circmetrics()`.
+#define WALK_BUCKETS 6     // Histogram buckets for 0, 1, 2, 4, 8 and more blocks
+
+struct stats {
+    uint64_t allocs;
+    uint64_t failures;
+    uint64_t frees;
+    uint64_t gapbytes;     // Bytes lost at the end of the buffer when wrapping
+    uint32_t peak;         // The most bytes used at the same time
+    uint64_t walks[WALK_BUCKETS];  // Blocks reclaimed by each free
+    uint64_t walked;       // Blocks reclaimed by all frees
+};
+
+extern struct stats circ_stats;
+
+// Some details on our list
+#define HDR_FREE 0     // This block is free
+#define HDR_INUSE 1    // This block is in use
+#define HDR_GAP 2      // This is a gap block. See free pointer for next element
+#define HDR_DONE 3     // This block is processed, and waits to be emitted in order
+#define HDR_COMMIT 4   // This block is written, and waits to be synced
+#define HDR_RESERVED 5 // The unused rest of a reservation, see `circreserve()`
+
+// Flags of a block.
+#define HDR_TOKEN 0x01 // Allocated from a reservation, so it has no sequence number
+
+// Must be 16 bytes or less in size, which is also our alignment.
+struct hdr {
+    uint8_t free;
+    uint8_t flags;
+    uint8_t site;      // Where this block was allocated, see `circprofile`
+    uint8_t schema;    // What the payload is, see `circtag`
+    uint32_t len;
+};
+
+// The size of the block for `size` bytes, including its header. Blocks are
+// aligned to 16 bytes. It wraps for sizes close to UINT32_MAX, so callers
+// check `size` against the buffer first.
+#define CIRC_BLOCKSIZE(size) (((size) + sizeof(struct hdr) + 0xF) & ~0xF)
+
+// Every n-th block allocated records where it was allocated from, so that
+// `circprofile()` can tell who uses the buffer. Zero disables profiling.
+extern uint32_t circ_profilerate;
+
+// The return addresses of the sampled allocations. The site in the header is
+// the index into this table plus one, and zero if the block wasn't sampled.
+#define SITE_MAX 64
+
+extern uintptr_t circ_sites[SITE_MAX];
+extern uint16_t circ_nsites;
+
+// Number of blocks a consumer claims from the ring at once.
+#define WORKER_BATCH 4
+
+// The blocks claimed by a single consumer. Only pointers into the ring are
+// kept, the payload is processed in place and freed by whichever consumer
+// processed it.
+struct worker {
+    void *blocks[WORKER_BATCH];
+    int first;     // The next block the owner processes
+    int last;      // One past the newest block, where others steal from
+};
+
+// Capacity taken from the buffer up front, so that a burst of blocks can be
+// allocated from it later without failing. The rest of the reservation is a
+// single block at `offset`, and blocks are split off its front.
+struct reservation {
+    uint32_t offset;
+    uint32_t left;     // Bytes not yet allocated, including the block headers
+};
+
+// Collects small records into one block, so they share a header and padding.
+// The block is published once it's full, or the first time the coalescer is
+// used `delay` after the first record, in `circclock()` units. Records are a
+// 32-bit length followed by the data, padded to 4 bytes, after the total
+// length of all records at the start of the block.
+#define COALESCE_SIZE 256  // The size of a block records are collected in
+
+struct coalescer {
+    struct reservation resv;   // The block being filled
+    uint32_t used;             // Bytes of records in it
+    uint64_t deadline;
+    uint64_t delay;
+};
+
+// A dump is this header, followed by the named cursors, the index entries
+// oldest first, and then all blocks from the tail to the head. Offsets in the
+// dump are those in the buffer, and are found in the dump at
+// `(offset - tail) % size` after the index.
+#define DUMP_MAGIC 0x43524943   // "CIRC" in little endian
+
+// Describes how blocks are laid out in the buffer, so that a program can check
+// if it understands a buffer written by another version before using it.
+// Change the version whenever `struct hdr` or the meaning of its fields change.
+#define LAYOUT_VERSION 5
+
+#define LAYOUT_SAME 0          // The buffer can be used as is
+#define LAYOUT_REPACK 1        // Only the size differs, blocks must be copied
+#define LAYOUT_INCOMPATIBLE -1 // The blocks can't be read
+
+struct layout {
+    uint16_t version;
+    uint8_t hdrsize;           // sizeof(struct hdr)
+    uint8_t align;             // Alignment of every block
+    uint32_t size;             // Size of the buffer
+};
+
+struct dumphdr {
+    uint32_t magic;
+    struct layout layout;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t seq;
+    uint32_t idxcount;
+    uint32_t claim;
+    uint32_t synced;
+    uint32_t ncursors;
+};
+
+// Called when a check in the allocator fails, e.g. a block is freed twice. If
+// not set, failed checks are ignored. Define CIRC_ASSERT before including this
+// header to use the platform's own assert instead.
+extern void (*circassert)(const char *expr, const char *file, int line);
+
+#ifndef CIRC_ASSERT
+#define CIRC_ASSERT(x) do { \
+        if (!(x) && circassert) circassert(#x, __FILE__, __LINE__); \
+    } while (0)
+#endif
+
+uint32_t circavail(void);
+void circreset(void);
+int circquiesce(uint64_t deadline);
+void circresume(void);
+void *circallocslow(uint32_t size);
+void circfree(void *addr);
+int circtrim(void *addr, uint32_t size);
+int circunalloc(void *addr);
+void circtag(void *addr, uint8_t schema);
+uint8_t circschema(const void *addr);
+
+int circreserve(struct reservation *r, uint32_t len);
+void *circresalloc(struct reservation *r, uint32_t size);
+void circresrelease(struct reservation *r);
+
+int circcoalesce(struct coalescer *c, const void *data, uint32_t len);
+void *circcoalflush(struct coalescer *c);
+void *circcoalpoll(struct coalescer *c);
+void *circrecord(void *block, uint32_t *pos, uint32_t *len);
+
+void *circnext(uint32_t *cursor, uint32_t limit);
+void *circwork(struct worker *workers, int nworkers, int self);
+void *circstage(uint32_t *cursors, int stage);
+void circstagedone(uint32_t *cursors, int stage);
+void circdone(void *addr);
+int circemit(void (*sink)(void *addr));
+
+void circcommit(void *addr);
+int circsync(void (*flush)(uint32_t offset, uint32_t len));
+int circdurable(void *addr);
+
+int circcursor(const char *name);
+uint32_t circcursorpos(int c);
+void circcursorsave(int c, uint32_t pos, int force);
+
+void *circseek(uint32_t n);
+void *circseektime(uint64_t time);
+
+void circlayout(struct layout *layout);
+int circlayoutcheck(const struct layout *layout);
+void circdump(void (*out)(const void *data, uint32_t len));
+int circdumpwalk(const uint8_t *data, uint32_t len,
+                 void (*decode)(void *ctx, const void *payload, uint32_t len),
+                 void *ctx);
+int circrestore(const uint8_t *dump, uint32_t len);
+
+int circreader(void);
+void circreaderdone(int r);
+void circquiescent(int r);
+int circreclaim(void);
+int circfree_deferred(void *addr);
+
+uint32_t circsnapshot(void);
+void circsnaprelease(uint32_t end);
+
+void circprofile(void (*out)(const void *data, uint32_t len));
+int circmetrics(char *buf, uint32_t len, const char *pool);
+
+// Allocate `size` bytes. Most allocations only write a header and move the
+// head, which is done here so it's inlined into the caller. Everything else,
+// i.e. wrapping, running out of space, indexing and sampling, is left to
+// `circallocslow()`. It's always inlined so that a sampled allocation records
+// the caller, and not this function, as its site.
+static inline __attribute__((always_inline)) void *circalloc(uint32_t size)
+{
+    uint32_t offset = circ_head;
+    uint32_t block_size = CIRC_BLOCKSIZE(size);
+    uint32_t used = (circ_head + BUFFSIZE - circ_tail) % BUFFSIZE;
+    struct hdr *meta;
+
+    // The oldest index entry must be dropped before the head moves over it,
+    // and there's only one call to the slow path, so that all its samples
+    // have the same return address.
+    if (!circ_draining && size < BUFFSIZE &&
+        (circ_head < circ_tail || BUFFSIZE - circ_head >= block_size) &&
+        BUFFSIZE - used > block_size &&
+        circ_seq % INDEX_EVERY != 0 &&
+        !(circ_profilerate && circ_seq % circ_profilerate == 0) &&
+        (circ_idxcount == 0 ||
+         (circ_blockindex[circ_idxfirst].offset + BUFFSIZE - circ_tail) % BUFFSIZE < used)) {
+        circ_seq++;
+        meta = (struct hdr *)(buffer + offset);
+        meta->free = HDR_INUSE;
+        meta->flags = 0;
+        meta->site = 0;
+        meta->schema = 0;
+        meta->len = block_size;
+        circ_head = (circ_head + block_size) % BUFFSIZE;
+
+        circ_stats.allocs++;
+        if (used + block_size > circ_stats.peak) circ_stats.peak = used + block_size;
+        return buffer + offset + sizeof(struct hdr);
+    }
+    return circallocslow(size);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,225 @@
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "circhost.h"
+
+struct dumpchunk {
+    const uint8_t *data;
+    uint32_t len;
+    void (*decode)(void *ctx, const void *payload, uint32_t len);
+    void *ctx;
+    int count;
+};
+
+static void *circdumpthread(void *arg)
+{
+    struct dumpchunk *chunk = arg;
+    chunk->count = circdumpwalk(chunk->data, chunk->len, chunk->decode, chunk->ctx);
+    return NULL;
+}
+
+// Decode a dump written by `circdump()` on up to `nthreads` threads. The
+// blocks are split in chunks of about the same size at index entries, and
+// chunk `i` is decoded with `ctx[i]` on its own thread, so the caller merges
+// the outputs by going through `ctx` in order. If a thread can't be started,
+// its chunk is decoded on the calling thread. Returns the number of chunks, or
+// -1 if this isn't a dump or its blocks are laid out differently.
+int circdumpdecode(const uint8_t *dump, uint32_t len, int nthreads,
+                   void (*decode)(void *ctx, const void *payload, uint32_t len),
+                   void **ctx)
+{
+    const struct dumphdr *dhdr = (const struct dumphdr *)dump;
+    const struct idxentry *entry;
+    const uint8_t *blocks;
+    uint32_t used;
+    uint32_t start = 0;
+    uint32_t i = 0;
+    int n = 0;
+
+    // The threads are on the stack, so there must be at least one.
+    if (nthreads < 1) return -1;
+    struct dumpchunk chunks[nthreads];
+    pthread_t threads[nthreads];
+    int started[nthreads];
+
+    if (len < sizeof(struct dumphdr) || dhdr->magic != DUMP_MAGIC) return -1;
+    if (circlayoutcheck(&dhdr->layout) == LAYOUT_INCOMPATIBLE) return -1;
+    if (dhdr->head >= dhdr->layout.size || dhdr->tail >= dhdr->layout.size) return -1;
+    used = (dhdr->head + dhdr->layout.size - dhdr->tail) % dhdr->layout.size;
+    entry = (const struct idxentry *)(dump + sizeof(struct dumphdr) +
+                                      dhdr->ncursors * sizeof(struct cursor));
+    blocks = (const uint8_t *)(entry + dhdr->idxcount);
+    if (blocks + used > dump + len) return -1;
+
+    // Each chunk ends at the first index entry past its share of the bytes.
+    while (n < nthreads && start < used) {
+        uint32_t end = used;
+        if (n < nthreads - 1) {
+            uint32_t target = (uint64_t)used * (n + 1) / nthreads;
+            for (; i < dhdr->idxcount; i++) {
+                uint32_t pos = (entry[i].offset + dhdr->layout.size - dhdr->tail) %
+                    dhdr->layout.size;
+                if (pos > start && pos >= target) {
+                    end = pos;
+                    break;
+                }
+            }
+        }
+        chunks[n].data = blocks + start;
+        chunks[n].len = end - start;
+        chunks[n].decode = decode;
+        chunks[n].ctx = ctx[n];
+        started[n] = pthread_create(&threads[n], NULL, circdumpthread, &chunks[n]) == 0;
+        if (!started[n]) circdumpthread(&chunks[n]);
+        start = end;
+        n++;
+    }
+
+    for (int t = 0; t < n; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+    return n;
+}
+
+// Read up to `size` bytes from `fd` directly into a new block, which is
+// trimmed to what was read. `len` is the result of `read()`. If nothing was
+// read, the block is taken back and NULL returned. If there's no space, `len`
+// is -1 with `errno` set to ENOBUFS.
+void *circread(int fd, uint32_t size, ssize_t *len)
+{
+    void *p = circalloc(size);
+    if (p == NULL) {
+        errno = ENOBUFS;
+        *len = -1;
+        return NULL;
+    }
+
+    *len = read(fd, p, size);
+    if (*len <= 0) {
+        int undone = circunalloc(p);
+        CIRC_ASSERT(undone == 0);
+        return NULL;
+    }
+
+    // It's still the newest block, and only shrinks, so this can't fail.
+    int trimmed = circtrim(p, *len);
+    CIRC_ASSERT(trimmed == 0);
+    return p;
+}
+
+// Like `circread()`, but with `recvmsg()`, so the caller can get the sender
+// and ancillary data with `msg`. The data always goes to the block, so
+// `msg_iov` is ignored. With MSG_TRUNC, `recvmsg()` returns the length of the
+// whole datagram, but `len` is what the block holds. The caller can tell it
+// was truncated from `msg_flags`.
+void *circrecvmsg(int fd, uint32_t size, struct msghdr *msg, int flags, ssize_t *len)
+{
+    struct iovec iov;
+    void *p = circalloc(size);
+    if (p == NULL) {
+        errno = ENOBUFS;
+        *len = -1;
+        return NULL;
+    }
+
+    iov.iov_base = p;
+    iov.iov_len = size;
+    msg->msg_iov = &iov;
+    msg->msg_iovlen = 1;
+    *len = recvmsg(fd, msg, flags);
+    msg->msg_iov = NULL;
+    msg->msg_iovlen = 0;
+    if (*len <= 0) {
+        int undone = circunalloc(p);
+        CIRC_ASSERT(undone == 0);
+        return NULL;
+    }
+    if (*len > size) *len = size;
+
+    int trimmed = circtrim(p, *len);
+    CIRC_ASSERT(trimmed == 0);
+    return p;
+}
+
+static uint64_t circns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Handle the blocks after the cursor of `p` with `handle`, freeing each one
+// after. The batch doubles each time it's filled, and halves when less than
+// half of it is. After `spins` empty polls in a row, the consumer sleeps until
+// a producer calls `circwake()`, but at most POLL_SLEEP_NS. That's also when
+// it waits at a reservation still in use or a block not synced yet. Returns
+// the number of blocks handled.
+//
+// Like `circwork`, this isn't lockless yet. `circ_head` is read atomically, but
+// `circfree()` must not run while the producer allocates.
+int circpoll(struct poller *p, void (*handle)(void *ctx, void *block), void *ctx)
+{
+    struct timespec timeout = { 0, POLL_SLEEP_NS };
+    uint64_t start = circns(CLOCK_THREAD_CPUTIME_ID);
+    uint32_t cursor;
+    uint32_t word;
+    uint32_t n = 0;
+    void *block;
+
+    if (p->batch == 0) p->batch = 1;
+    while (n < p->batch &&
+           (block = circnext(&p->cursor, __atomic_load_n(&circ_head, __ATOMIC_ACQUIRE))) != NULL) {
+        handle(ctx, block);
+        circfree(block);
+        n++;
+    }
+    p->polls++;
+    p->blocks += n;
+    if (n == p->batch) {
+        if (p->batch < POLL_BATCH_MAX) p->batch *= 2;
+    } else if (n < p->batch / 2) {
+        p->batch /= 2;
+    }
+
+    if (n > 0) {
+        p->idle = 0;
+    } else if (++p->idle >= p->spins) {
+        // A producer either sees that we sleep and changes the futex, so we
+        // don't, or stored `circ_head` in `circwake()` before, so we see the
+        // block and don't sleep. Both sides store, then load, sequentially
+        // consistent, so they can't both miss the other.
+        __atomic_store_n(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+        word = __atomic_load_n(&p->wake, __ATOMIC_SEQ_CST);
+        cursor = p->cursor;
+        if (circnext(&cursor, __atomic_load_n(&circ_head, __ATOMIC_SEQ_CST)) == NULL) {
+            p->cputime += circns(CLOCK_THREAD_CPUTIME_ID) - start;
+            syscall(SYS_futex, &p->wake, FUTEX_WAIT_PRIVATE, word, &timeout, NULL, 0);
+            start = circns(CLOCK_THREAD_CPUTIME_ID);
+            p->sleeps++;
+        }
+        __atomic_store_n(&p->sleeping, 0, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&p->wake, __ATOMIC_SEQ_CST) != word) {
+            p->wakes++;
+            p->wakelat += circns(CLOCK_MONOTONIC) -
+                __atomic_load_n(&p->woken, __ATOMIC_ACQUIRE);
+        }
+        p->idle = 0;
+    }
+    p->cputime += circns(CLOCK_THREAD_CPUTIME_ID) - start;
+    return n;
+}
+
+// Wake the consumer of `p` if it sleeps. Producers call this after publishing
+// a block, releasing a reservation or syncing. Only the producer moves the
+// head, so it stores it again to publish it, see `circpoll()`.
+void circwake(struct poller *p)
+{
+    __atomic_store_n(&circ_head, circ_head, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&p->sleeping, __ATOMIC_SEQ_CST)) return;
+    __atomic_store_n(&p->woken, circns(CLOCK_MONOTONIC), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&p->wake, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &p->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
@@ -0,0 +1,41 @@
+#ifndef CIRCHOST_H
+#define CIRCHOST_H
+
+// Helpers that need an operating system, for programs that have one.
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "circalloc.h"
+
+// A consumer that spins while blocks keep coming, and sleeps when they don't.
+// Set `cursor` to where it starts reading and `spins`, the rest is zero.
+#define POLL_BATCH_MAX 64          // Most blocks handled per poll
+#define POLL_SLEEP_NS 1000000      // Longest sleep if no producer wakes it
+
+struct poller {
+    uint32_t cursor;
+    uint32_t spins;        // Empty polls in a row before sleeping
+    uint32_t batch;        // Blocks handled per poll, grows under load
+    uint32_t idle;         // Empty polls in a row so far
+    uint32_t wake;         // The futex the consumer sleeps on
+    uint32_t sleeping;
+    uint64_t woken;        // When a producer woke the consumer
+    // What it achieved, times in nanoseconds.
+    uint64_t polls;
+    uint64_t blocks;
+    uint64_t sleeps;
+    uint64_t wakes;
+    uint64_t wakelat;      // From `circwake()` until the consumer runs
+    uint64_t cputime;      // Spent by the consumer polling and handling
+};
+
+int circdumpdecode(const uint8_t *dump, uint32_t len, int nthreads,
+                   void (*decode)(void *ctx, const void *payload, uint32_t len),
+                   void **ctx);
+
+void *circread(int fd, uint32_t size, ssize_t *len);
+void *circrecvmsg(int fd, uint32_t size, struct msghdr *msg, int flags, ssize_t *len);
+
+int circpoll(struct poller *p, void (*handle)(void *ctx, void *block), void *ctx);
+void circwake(struct poller *p);
+
+#endif
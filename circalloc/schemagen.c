@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Generate typed views over block payloads from a schema read from stdin,
+// e.g.
+//
+//   # A trade on the exchange
+//   record trade 1
+//       u64 time
+//       u32 price
+//       u16 quantity
+//       char[8] symbol
+//   end
+//
+// The number after the name is the schema id the blocks are tagged with, from
+// 1 to 255, and different for every record. Fields are laid out in order, each
+// aligned to its own size, so the accessors read them in place without any
+// parsing. The header is written to stdout, and works for both C and C++. Its
+// include guard is made from the header's name, if it's given as the argument.
+
+struct type {
+    const char *name;
+    const char *ctype;
+    int size;
+};
+
+static const struct type types[] = {
+    { "u8", "uint8_t", 1 }, { "u16", "uint16_t", 2 },
+    { "u32", "uint32_t", 4 }, { "u64", "uint64_t", 8 },
+    { "i8", "int8_t", 1 }, { "i16", "int16_t", 2 },
+    { "i32", "int32_t", 4 }, { "i64", "int64_t", 8 },
+    { "f32", "float", 4 }, { "f64", "double", 8 },
+};
+
+#define FIELD_MAX 64
+
+static int line;
+
+static void fail(const char *msg)
+{
+    fprintf(stderr, "schemagen: line %d: %s\n", line, msg);
+    exit(1);
+}
+
+static void upper(char *dst, const char *src)
+{
+    while (*src) *dst++ = toupper((unsigned char)*src++);
+    *dst = '\0';
+}
+
+// Add the field `name` to the record's fields, failing if it's there already.
+static void field(char fields[][64], int *nfields, const char *name)
+{
+    for (int i = 0; i < *nfields; i++) {
+        if (strcmp(fields[i], name) == 0) fail("duplicate field");
+    }
+    if (*nfields == FIELD_MAX) fail("too many fields");
+    strcpy(fields[(*nfields)++], name);
+}
+
+int main(int argc, char **argv)
+{
+    char buf[256];
+    char record[64] = "";
+    char rupper[64];
+    char type[32];
+    char name[64];
+    char guard[64] = "SCHEMA_H";
+    char fields[FIELD_MAX][64];
+    int nfields = 0;
+    char ids[256] = { 0 };
+    int offset = 0;
+    int align = 1;
+    int id;
+    int len;
+
+    // e.g. "testschema.h" becomes TESTSCHEMA_H.
+    if (argc > 1) {
+        const char *s = strrchr(argv[1], '/') ? strrchr(argv[1], '/') + 1 : argv[1];
+        size_t i = 0;
+        for (; s[i] && i < sizeof(guard) - 1; i++) {
+            guard[i] = isalnum((unsigned char)s[i]) ? toupper((unsigned char)s[i]) : '_';
+        }
+        guard[i] = '\0';
+    }
+
+    printf("// Generated by schemagen, don't edit.\n");
+    printf("#ifndef %s\n", guard);
+    printf("#define %s\n\n", guard);
+    printf("#include \"circalloc.h\"\n");
+    while (fgets(buf, sizeof(buf), stdin)) {
+        line++;
+        char *p = buf + strspn(buf, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+        if (sscanf(p, "record %63s %d", name, &id) == 2) {
+            if (record[0]) fail("record inside a record");
+            if (id < 1 || id > 255) fail("schema id must be from 1 to 255");
+            if (ids[id]) fail("duplicate schema id");
+            ids[id] = 1;
+            strcpy(record, name);
+            nfields = 0;
+            upper(rupper, record);
+            offset = 0;
+            align = 1;
+            printf("\n#define %s_SCHEMA %d\n", rupper, id);
+            printf("\n// The payload of the block at `p` as a %s, or NULL if it isn't one.\n",
+                   record);
+            printf("static inline void *%s_view(void *p)\n{\n", record);
+            printf("    return circschema(p) == %s_SCHEMA ? p : NULL;\n}\n", rupper);
+            continue;
+        }
+        if (strncmp(p, "end", 3) == 0 && (p[3] == '\0' || isspace((unsigned char)p[3]))) {
+            if (!record[0]) fail("end outside a record");
+            offset = (offset + align - 1) / align * align;
+            printf("\n#define %s_SIZE %d\n", rupper, offset);
+            printf("\n// Allocate a %s, tagged with its schema.\n", record);
+            printf("static inline void *%s_alloc(void)\n{\n", record);
+            printf("    void *p = circalloc(%s_SIZE);\n", rupper);
+            printf("    if (p) circtag(p, %s_SCHEMA);\n", rupper);
+            printf("    return p;\n}\n");
+            record[0] = '\0';
+            continue;
+        }
+        if (!record[0]) fail("field outside a record");
+        if (sscanf(p, "char[%d] %63s", &len, name) == 2) {
+            if (len < 1) fail("bad array length");
+            field(fields, &nfields, name);
+            printf("\nstatic inline char *%s_%s(void *p)\n{\n", record, name);
+            printf("    return (char *)p + %d;\n}\n", offset);
+            offset += len;
+            continue;
+        }
+        if (sscanf(p, "%31s %63s", type, name) != 2) fail("expected a field");
+
+        const struct type *t = NULL;
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if (strcmp(types[i].name, type) == 0) t = &types[i];
+        }
+        if (t == NULL) fail("unknown type");
+        field(fields, &nfields, name);
+        offset = (offset + t->size - 1) / t->size * t->size;
+        if (t->size > align) align = t->size;
+        printf("\nstatic inline %s %s_%s(const void *p)\n{\n", t->ctype, record, name);
+        printf("    return *(const %s *)((const uint8_t *)p + %d);\n}\n", t->ctype, offset);
+        printf("\nstatic inline void %s_set_%s(void *p, %s v)\n{\n", record, name, t->ctype);
+        printf("    *(%s *)((uint8_t *)p + %d) = v;\n}\n", t->ctype, offset);
+        offset += t->size;
+    }
+    if (record[0]) fail("missing end");
+    printf("\n#endif\n");
+    return 0;
+}